@@ -0,0 +1,34 @@
+; Division kernel for the i64 division narrowing. Each iteration does four
+; i64 divisions or remainders: two whose operands are both proven to fit in
+; i32, and two whose dividend is loaded from memory, which only
+; -type-downcaster-guarded-division speeds up. See README.md.
+
+define i64 @kernel(i64* %data, i64 %n) {
+entry:
+  %empty = icmp sle i64 %n, 0
+  br i1 %empty, label %exit, label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i64 [ 0, %entry ], [ %acc.next, %loop ]
+  %idx = and i64 %i, 1023
+  %p = getelementptr inbounds i64, i64* %data, i64 %idx
+  %x = load i64, i64* %p
+  %a = and i64 %i, 1048575
+  %b = add nuw nsw i64 %idx, 1
+  %q1 = udiv i64 %a, %b
+  %r1 = urem i64 %a, %b
+  %q2 = sdiv i64 %x, %b
+  %r2 = srem i64 %x, %b
+  %s1 = add i64 %q1, %r1
+  %s2 = add i64 %q2, %r2
+  %s3 = xor i64 %s1, %s2
+  %acc.next = add i64 %acc, %s3
+  %i.next = add nuw nsw i64 %i, 1
+  %done = icmp eq i64 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  %r = phi i64 [ 0, %entry ], [ %acc.next, %loop ]
+  ret i64 %r
+}
@@ -0,0 +1,25 @@
+// Times the division kernel of division.ll. See README.md.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+int64_t kernel(int64_t *data, int64_t n);
+
+int main(int argc, char **argv) {
+  int64_t n = argc > 1 ? atoll(argv[1]) : 200000000;
+  static int64_t data[1024];
+  for (int i = 0; i < 1024; ++i)
+    data[i] = (i * 7919) % 100003 - 50000;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int64_t result = kernel(data, n);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  printf("%.3f s (result %lld)\n", seconds, (long long)result);
+  return 0;
+}
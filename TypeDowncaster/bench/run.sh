@@ -0,0 +1,34 @@
+#!/bin/sh
+# Builds the division kernel three times, without the pass, with the pass,
+# and with the pass and guarded divisions, then times each build.
+#
+# Usage: bench/run.sh <plugin> [iterations] [llc flags...]
+# OPT, LLC and CC select the tools.
+set -e
+
+PLUGIN=$1
+ITERATIONS=${2:-200000000}
+shift
+[ $# -gt 0 ] && shift
+LLC_FLAGS="$*"
+
+OPT=${OPT:-opt}
+LLC=${LLC:-llc}
+CC=${CC:-cc}
+BENCH=$(cd "$(dirname "$0")" && pwd)
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+"$OPT" -S "$BENCH/division.ll" -o "$OUT/baseline.ll"
+"$OPT" -load="$PLUGIN" -load-pass-plugin="$PLUGIN" -passes=type-downcaster -S \
+  "$BENCH/division.ll" -o "$OUT/proven.ll"
+"$OPT" -load="$PLUGIN" -load-pass-plugin="$PLUGIN" -passes=type-downcaster \
+  -type-downcaster-guarded-division -S "$BENCH/division.ll" \
+  -o "$OUT/guarded.ll"
+
+for NAME in baseline proven guarded; do
+  "$LLC" -O2 $LLC_FLAGS "$OUT/$NAME.ll" -o "$OUT/$NAME.s"
+  "$CC" -O2 "$BENCH/main.c" "$OUT/$NAME.s" -o "$OUT/$NAME"
+  printf '%-9s ' "$NAME"
+  "$OUT/$NAME" "$ITERATIONS"
+done
@@ -5,31 +5,60 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "llvm/ADT/EquivalenceClasses.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/DemandedBits.h"
+#include "llvm/Analysis/LazyValueInfo.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/ConstantRange.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Mangler.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/IR/PatternMatch.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Value.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/IR/ValueMap.h"
 #include "llvm/Pass.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/KnownBits.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
 #include <algorithm>
-#include <map>
-#include <set>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <memory>
 #include <string>
 #include <vector>
 
+#ifdef TYPEDOWNCASTER_HAVE_SMT
+#include <z3.h>
+#endif
+
 using namespace llvm;
 
 #define DEBUG_TYPE "typedowncaster"
@@ -39,81 +68,933 @@ STATISTIC(NumGlobalsOptimized, "Number of globals optimized");
 STATISTIC(NumStructFieldsOptimized, "Number of struct fields optimized");
 STATISTIC(NumFloatToFloatOptimized, "Number of double to float conversions");
 STATISTIC(NumTotalBytesReduced, "Total number of bytes reduced in memory allocation");
+STATISTIC(NumGlobalsRejected, "Number of globals kept wide because their uses could not be rewritten");
+STATISTIC(NumAllocasRejected, "Number of allocas kept wide because narrowing was not proven safe");
+STATISTIC(NumOperationsNarrowed, "Number of i64 arithmetic and compare instructions narrowed to i32");
+STATISTIC(NumDivisionsNarrowed, "Number of i64 divisions and remainders narrowed to i32");
+STATISTIC(NumDivisionsGuarded, "Number of i64 divisions given a guarded i32 fast path");
+STATISTIC(NumDemandedBitsProofs, "Number of slots and operations narrowed because only their low 32 bits are observed");
+STATISTIC(NumErrorBoundProofs, "Number of double slots narrowed because their rounding error stays within the tolerance");
+STATISTIC(NumRangesFromConstants, "Number of narrowing proofs of constant values");
+STATISTIC(NumRangesFromSCEV, "Number of narrowing proofs whose tightest range came from ScalarEvolution");
+STATISTIC(NumRangesFromKnownBits, "Number of narrowing proofs whose tightest range came from known bits");
+STATISTIC(NumRangesFromSignBits, "Number of narrowing proofs whose tightest range came from sign bits");
+STATISTIC(NumRangesFromInterprocedural, "Number of narrowing proofs whose tightest range came from interprocedural facts");
+STATISTIC(NumRangesFromIntervals, "Number of narrowing proofs whose tightest range came from interval analysis");
+STATISTIC(NumRangesFromRelations, "Number of narrowing proofs whose tightest range came from the relational domain");
+STATISTIC(NumRangesFromConditions, "Number of narrowing proofs whose tightest range came from dominating conditions and assumptions");
+STATISTIC(NumRangesFromSMT, "Number of narrowing proofs found by the SMT solver");
+STATISTIC(NumRangesFromLVI, "Number of narrowing proofs whose tightest range came from LazyValueInfo");
+STATISTIC(NumRangesFromCombination, "Number of narrowing proofs that needed the intersection of several sources");
+STATISTIC(NumParametersNarrowed, "Number of parameters of internal functions narrowed");
+STATISTIC(NumReturnsNarrowed, "Number of return types of internal functions narrowed");
+STATISTIC(NumFunctionsSpecialized, "Number of functions cloned for call sites with narrow arguments");
+STATISTIC(NumCallSitesSpecialized, "Number of call sites redirected to a specialized clone");
+STATISTIC(NumInterproceduralFacts, "Number of argument and return ranges bounded across calls");
+
+static cl::opt<bool> GuardedDivision(
+    "type-downcaster-guarded-division", cl::init(false),
+    cl::desc("Give i64 divisions with one operand proven to fit in i32 a "
+             "fast path that checks the other operand at run time"));
+
+static cl::opt<unsigned> SpecializationBudget(
+    "type-downcaster-specialization-budget", cl::init(0),
+    cl::desc("Number of instructions that may be added by cloning functions "
+             "for call sites with narrow arguments (0 disables "
+             "specialization)"));
+
+static cl::opt<unsigned> RelationalBudget(
+    "type-downcaster-relational-budget", cl::init(0),
+    cl::desc("Number of closure steps per function that the relational "
+             "domain may spend bounding differences (0 disables it)"));
+
+static cl::opt<double> FPTolerance(
+    "type-downcaster-fp-tolerance", cl::init(0.0),
+    cl::desc("Largest relative error that narrowing double slots to float "
+             "may introduce into any double value (0 only narrows slots "
+             "whose stored values are exactly representable as float)"));
+
+#ifdef TYPEDOWNCASTER_HAVE_SMT
+STATISTIC(NumSMTQueries, "Number of queries solved by the SMT solver");
+STATISTIC(NumSMTCacheHits, "Number of SMT queries answered from the cache");
+
+static cl::opt<bool> SMTProofs(
+    "type-downcaster-smt", cl::init(false),
+    cl::desc("Ask the SMT solver to prove the integer narrowings that every "
+             "range analysis rejects"));
+
+static cl::opt<unsigned> SMTTimeout(
+    "type-downcaster-smt-timeout", cl::init(100),
+    cl::desc("Time limit of one SMT query in milliseconds"));
+#endif
 
 namespace {
 
-// Helper class to handle replacement of values and to track pending replacements
+// Helper class to handle replacement of values and to track pending replacements.
+//
+// Everything is held through value handles: the recorded slots become null
+// instead of dangling if another utility erases them.
+// Pending removals only live for the duration of one rewrite, so they use
+// AssertingVH, which is free in release builds and catches misuse in
+// assertion builds. clear() keeps the allocated storage, so in module mode
+// it is reused from one function to the next.
 class ReplacementTracker {
-  std::map<Value *, Value *> Replacements;
-  std::map<AllocaInst *, AllocaInst *> AllocaReplacements;
-  std::map<GlobalVariable *, GlobalVariable *> GlobalReplacements;
-  std::set<Instruction *> ToRemove;
-  SmallPtrSet<Value *, 16> Processed;
+public:
+  using SlotReplacement = std::pair<WeakTrackingVH, WeakTrackingVH>;
+
+private:
+  SmallVector<SlotReplacement, 16> AllocaReplacements;
+  SmallVector<SlotReplacement, 8> GlobalReplacements;
+  SmallVector<AssertingVH<Instruction>, 64> ToRemove;
 
 public:
-  void addReplacement(Value *Old, Value *New) { 
-    Replacements[Old] = New; 
-  }
-  
   void addAllocaReplacement(AllocaInst *Old, AllocaInst *New) {
-    AllocaReplacements[Old] = New;
-    addReplacement(Old, New);
+    AllocaReplacements.emplace_back(Old, New);
   }
   
   void addGlobalReplacement(GlobalVariable *Old, GlobalVariable *New) {
-    GlobalReplacements[Old] = New;
-    addReplacement(Old, New);
+    GlobalReplacements.emplace_back(Old, New);
   }
 
   void markForRemoval(Instruction *I) {
-    ToRemove.insert(I);
-  }
-
-  bool hasReplacement(Value *V) const {
-    return Replacements.count(V) > 0;
-  }
-
-  Value *getReplacement(Value *V) const {
-    auto It = Replacements.find(V);
-    if (It != Replacements.end())
-      return It->second;
-    return nullptr;
-  }
-
-  void markProcessed(Value *V) {
-    Processed.insert(V);
+    ToRemove.emplace_back(I);
   }
 
-  bool isProcessed(Value *V) const {
-    return Processed.count(V) > 0;
+  void clearToRemove() {
+    ToRemove.clear();
   }
 
-  const std::map<AllocaInst *, AllocaInst *> &getAllocaReplacements() const {
+  ArrayRef<SlotReplacement> getAllocaReplacements() const {
     return AllocaReplacements;
   }
 
-  const std::map<GlobalVariable *, GlobalVariable *> &getGlobalReplacements() const {
+  ArrayRef<SlotReplacement> getGlobalReplacements() const {
     return GlobalReplacements;
   }
 
-  const std::set<Instruction *> &getToRemove() const {
+  ArrayRef<AssertingVH<Instruction>> getToRemove() const {
     return ToRemove;
   }
 
   void clear() {
-    Replacements.clear();
     AllocaReplacements.clear();
     GlobalReplacements.clear();
     ToRemove.clear();
-    Processed.clear();
   }
 };
 
+// Loads and stores that reach a candidate memory slot, either directly or
+// through a chain of GEPs
+struct SlotAccesses {
+  SmallVector<LoadInst *, 8> Loads;
+  SmallVector<StoreInst *, 8> Stores;
+};
+
+// Memoized answers of the type queries. Types are uniqued per LLVMContext,
+// so each aggregate is examined and narrowed at most once per run. The
+// cache is dropped at the end of every run: the context may be destroyed
+// afterwards, and a new one may be allocated at the same address.
+class TypeMappingCache {
+  DenseMap<Type *, bool> Eligible;
+  DenseMap<Type *, Type *> Optimized;
+
+public:
+  Optional<bool> lookupEligible(Type *Ty) {
+    auto It = Eligible.find(Ty);
+    if (It == Eligible.end())
+      return None;
+    return It->second;
+  }
+
+  void recordEligible(Type *Ty, bool IsEligible) {
+    Eligible[Ty] = IsEligible;
+  }
+
+  Type *lookupOptimized(Type *Ty) {
+    auto It = Optimized.find(Ty);
+    return It == Optimized.end() ? nullptr : It->second;
+  }
+
+  void recordOptimized(Type *Ty, Type *OptimizedTy) {
+    Optimized[Ty] = OptimizedTy;
+  }
+
+  void clear() {
+    Eligible.clear();
+    Optimized.clear();
+  }
+};
+
+// What the read-only scan of one function found. Everything that needs an
+// analysis or creates IR is decided later from the plan.
+struct FunctionPlan {
+  Function *F = nullptr;
+  // Eligible allocas whose uses are all understood, with their accesses
+  SmallVector<AllocaInst *, 8> Candidates;
+  SmallVector<SlotAccesses, 8> Accesses;
+  // Eligible allocas that were rejected without needing any analysis
+  SmallVector<std::pair<AllocaInst *, StringRef>, 4> Rejected;
+  // i64 arithmetic that could be computed in i32
+  SmallVector<Instruction *, 16> Operations;
+  // i64 divisions and remainders
+  SmallVector<BinaryOperator *, 4> Divisions;
+};
+
+// Which parameters and return type of an internal function are narrowed
+struct SignaturePlan {
+  Function *F = nullptr;
+  SmallVector<bool, 8> NarrowParam;
+  bool NarrowReturn = false;
+};
+
+// Every caller of F is visible in this module: F has local linkage, takes a
+// fixed number of arguments, and every use of it is the callee of a direct
+// call with its own function type
+static bool hasOnlyDirectCalls(const Function &F) {
+  if (!F.hasLocalLinkage() || F.isVarArg())
+    return false;
+  for (const Use &U : F.uses()) {
+    auto *Call = dyn_cast<CallBase>(U.getUser());
+    if (!Call || !Call->isCallee(&U) ||
+        Call->getFunctionType() != F.getFunctionType())
+      return false;
+  }
+  return true;
+}
+
+// Argument ranges assumed on top of the interprocedural facts
+using ArgumentRangeMap = SmallDenseMap<const Argument *, ConstantRange, 8>;
+
+// Signed ranges of integer arguments and return values, propagated over the
+// call graph.
+//
+// An argument only gets a fact when its function has local linkage and every
+// use of the function is a direct call, so all incoming values are known.
+// A return value gets a fact when the definition is exact, so calls that
+// resolve to it really run this body. Everything else is the full range.
+// Facts are keyed by Argument and Function, which outlive the rewrites done
+// by the pass, so the result stays usable for the whole module run.
+class InterproceduralRanges {
+  friend class InterproceduralRangeAnalysis;
+
+  DenseMap<const Argument *, ConstantRange> ArgRanges;
+  DenseMap<const Function *, ConstantRange> ReturnRanges;
+
+  ConstantRange evaluate(const Value *V, const ArgumentRangeMap *Assumed,
+                         unsigned Depth) const {
+    unsigned BitWidth = V->getType()->getIntegerBitWidth();
+    if (auto *ConstInt = dyn_cast<ConstantInt>(V))
+      return ConstantRange(ConstInt->getValue());
+    if (auto *Arg = dyn_cast<Argument>(V)) {
+      if (Assumed) {
+        auto It = Assumed->find(Arg);
+        if (It != Assumed->end())
+          return It->second;
+      }
+      return getArgumentRange(*Arg);
+    }
+
+    // Undef and poison fall through to the full range: each use of undef
+    // may see a different value, so it cannot be treated as bottom
+    const Instruction *I = dyn_cast<Instruction>(V);
+    if (!I || Depth >= MaxDepth)
+      return ConstantRange::getFull(BitWidth);
+
+    ConstantRange Range = ConstantRange::getFull(BitWidth);
+    if (const MDNode *RangeMD = I->getMetadata(LLVMContext::MD_range))
+      Range = getConstantRangeFromMetadata(*RangeMD);
+
+    if (auto *Call = dyn_cast<CallBase>(I)) {
+      if (const Function *Callee = Call->getCalledFunction())
+        Range = Range.intersectWith(getReturnRange(*Callee),
+                                    ConstantRange::Signed);
+    } else if (auto *BinOp = dyn_cast<BinaryOperator>(I)) {
+      ConstantRange LHS = evaluate(BinOp->getOperand(0), Assumed, Depth + 1);
+      ConstantRange RHS = evaluate(BinOp->getOperand(1), Assumed, Depth + 1);
+      Range = LHS.binaryOp(BinOp->getOpcode(), RHS);
+    } else if (auto *Cast = dyn_cast<CastInst>(I)) {
+      if (Cast->getSrcTy()->isIntegerTy())
+        Range = evaluate(Cast->getOperand(0), Assumed, Depth + 1)
+                    .castOp(Cast->getOpcode(), BitWidth);
+    } else if (auto *Select = dyn_cast<SelectInst>(I)) {
+      Range = evaluate(Select->getTrueValue(), Assumed, Depth + 1)
+                  .unionWith(evaluate(Select->getFalseValue(), Assumed, Depth + 1),
+                             ConstantRange::Signed);
+    } else if (auto *Phi = dyn_cast<PHINode>(I)) {
+      // Cycles through loop phis run into the depth limit and end up full
+      Range = ConstantRange::getEmpty(BitWidth);
+      for (const Value *Incoming : Phi->incoming_values()) {
+        Range = Range.unionWith(evaluate(Incoming, Assumed, Depth + 1),
+                                ConstantRange::Signed);
+        if (Range.isFullSet())
+          break;
+      }
+    }
+    return Range;
+  }
+
+public:
+  // How many instructions deep an expression is followed towards its leaves
+  static const unsigned MaxDepth = 6;
+
+  ConstantRange getArgumentRange(const Argument &Arg) const {
+    auto It = ArgRanges.find(&Arg);
+    if (It != ArgRanges.end())
+      return It->second;
+    return ConstantRange::getFull(Arg.getType()->getIntegerBitWidth());
+  }
+
+  ConstantRange getReturnRange(const Function &F) const {
+    auto It = ReturnRanges.find(&F);
+    if (It != ReturnRanges.end())
+      return It->second;
+    return ConstantRange::getFull(F.getReturnType()->getIntegerBitWidth());
+  }
+
+  /**
+   * Computes the signed range of an integer value from the expression that
+   * defines it, using the argument and return facts at its leaves.
+   *
+   * @param V The integer Value to analyze
+   * @param Assumed Argument ranges that take precedence over the facts
+   * @return a conservative signed range containing every value V can take
+   */
+  ConstantRange getRange(const Value *V,
+                         const ArgumentRangeMap *Assumed = nullptr) const {
+    return evaluate(V, Assumed, 0);
+  }
+};
+
+// Computes InterproceduralRanges as an optimistic fixed point: facts start
+// out empty and only ever grow. Facts that keep growing after
+// MaxRefinementRounds (recursion that counts up, for instance) are widened
+// to the full range, so the iteration always terminates.
+class InterproceduralRangeAnalysis
+    : public AnalysisInfoMixin<InterproceduralRangeAnalysis> {
+  friend AnalysisInfoMixin<InterproceduralRangeAnalysis>;
+  static AnalysisKey Key;
+
+  static const unsigned MaxRefinementRounds = 8;
+
+public:
+  using Result = InterproceduralRanges;
+
+  Result run(Module &M, ModuleAnalysisManager &) {
+    Result Ranges;
+    for (const Function &F : M) {
+      if (F.isDeclaration())
+        continue;
+      if (F.getReturnType()->isIntegerTy() && F.hasExactDefinition())
+        Ranges.ReturnRanges.try_emplace(
+            &F, ConstantRange::getEmpty(F.getReturnType()->getIntegerBitWidth()));
+      if (!hasOnlyDirectCalls(F))
+        continue;
+      for (const Argument &Arg : F.args())
+        if (Arg.getType()->isIntegerTy())
+          Ranges.ArgRanges.try_emplace(
+              &Arg, ConstantRange::getEmpty(Arg.getType()->getIntegerBitWidth()));
+    }
+
+    if (Ranges.ArgRanges.empty() && Ranges.ReturnRanges.empty())
+      return Ranges;
+
+    bool Changed = true;
+    for (unsigned Round = 0; Changed; ++Round) {
+      Changed = false;
+      bool Widen = Round >= MaxRefinementRounds;
+      auto Join = [&](ConstantRange &Fact, const ConstantRange &New) {
+        ConstantRange Joined = Fact.unionWith(New, ConstantRange::Signed);
+        if (Joined == Fact)
+          return;
+        Fact = Widen ? ConstantRange::getFull(Fact.getBitWidth()) : Joined;
+        Changed = true;
+      };
+
+      for (const Function &F : M) {
+        for (const BasicBlock &BB : F) {
+          for (const Instruction &I : BB) {
+            if (auto *Ret = dyn_cast<ReturnInst>(&I)) {
+              auto It = Ranges.ReturnRanges.find(&F);
+              if (It != Ranges.ReturnRanges.end() && Ret->getReturnValue())
+                Join(It->second, Ranges.getRange(Ret->getReturnValue()));
+              continue;
+            }
+            auto *Call = dyn_cast<CallBase>(&I);
+            const Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+            if (!Callee)
+              continue;
+            for (const Argument &Arg : Callee->args()) {
+              auto It = Ranges.ArgRanges.find(&Arg);
+              if (It != Ranges.ArgRanges.end())
+                Join(It->second,
+                     Ranges.getRange(Call->getArgOperand(Arg.getArgNo())));
+            }
+          }
+        }
+      }
+    }
+
+    for (const auto &Entry : Ranges.ArgRanges)
+      NumInterproceduralFacts += !Entry.second.isFullSet();
+    for (const auto &Entry : Ranges.ReturnRanges)
+      NumInterproceduralFacts += !Entry.second.isFullSet();
+
+    LLVM_DEBUG({
+      for (const auto &Entry : Ranges.ArgRanges)
+        if (!Entry.second.isFullSet())
+          dbgs() << "TypeDowncaster: Argument " << Entry.first->getName()
+                 << " of " << Entry.first->getParent()->getName() << " is in "
+                 << Entry.second << "\n";
+      for (const auto &Entry : Ranges.ReturnRanges)
+        if (!Entry.second.isFullSet())
+          dbgs() << "TypeDowncaster: Return value of "
+                 << Entry.first->getName() << " is in " << Entry.second
+                 << "\n";
+    });
+    return Ranges;
+  }
+};
+
+AnalysisKey InterproceduralRangeAnalysis::Key;
+
+// Signed ranges of the integer values of one function, computed by interval
+// abstract interpretation. They hold wherever a value is used. The map
+// follows the IR: deleted values are dropped, and replaced values hand their
+// range on to the replacement.
+class IntervalRanges {
+  friend class IntervalInterpreter;
+
+  std::unique_ptr<ValueMap<const Value *, ConstantRange>> Ranges =
+      std::make_unique<ValueMap<const Value *, ConstantRange>>();
+
+public:
+  ConstantRange getRange(const Value *V) const {
+    auto It = Ranges->find(V);
+    if (It != Ranges->end())
+      return It->second;
+    return ConstantRange::getFull(V->getType()->getIntegerBitWidth());
+  }
+};
+
+// Runs the interval interpreter over one function.
+//
+// Blocks are visited in reverse post-order until nothing changes. Integer
+// stack slots whose address never escapes are variables whose range is the
+// join of all values stored into them. Loop header phis and slots are
+// widening points: after WideningDelay growths, a bound that still moves
+// jumps to the signed limit. Accumulators (a header phi or slot that is only
+// ever incremented inside a loop with a constant maximum trip count) are
+// clamped to their initial values plus trip count times their step, which
+// is what recovers bounds after widening. A few narrowing passes follow.
+class IntervalInterpreter {
+  // Growths of a widening point before it is widened, narrowing passes, and
+  // ascending passes before the function is given up on
+  static const unsigned WideningDelay = 2;
+  static const unsigned NarrowingPasses = 2;
+  static const unsigned MaxPasses = 32;
+
+  // Initial values plus at most Count increments by the steps; the second
+  // member of a step is set when it is subtracted
+  struct Accumulation {
+    SmallVector<Value *, 2> Inits;
+    SmallVector<std::pair<Value *, bool>, 2> Steps;
+    uint64_t Count = 0;
+  };
+
+  Function &F;
+  LoopInfo &LI;
+  ScalarEvolution &SE;
+  std::vector<BasicBlock *> Blocks;
+  DenseMap<const Value *, ConstantRange> State;
+  DenseMap<const Value *, unsigned> Growths;
+  DenseMap<const Value *, Accumulation> Accumulations;
+  MapVector<AllocaInst *, SmallVector<StoreInst *, 4>> Slots;
+
+  // Only integer slots that are loaded and stored directly are variables
+  static bool isTrackedSlot(const AllocaInst &AI) {
+    Type *Ty = AI.getAllocatedType();
+    if (!Ty->isIntegerTy() || !AI.isStaticAlloca() || AI.isArrayAllocation())
+      return false;
+    for (const User *U : AI.users()) {
+      if (auto *Load = dyn_cast<LoadInst>(U)) {
+        if (!Load->isSimple() || Load->getType() != Ty)
+          return false;
+      } else if (auto *Store = dyn_cast<StoreInst>(U)) {
+        if (!Store->isSimple() || Store->getValueOperand() == &AI ||
+            Store->getValueOperand()->getType() != Ty)
+          return false;
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Matches V = Base + Step or V = Base - Step
+  static bool matchIncrement(Value *V, function_ref<bool(Value *)> IsBase,
+                             Accumulation &Acc) {
+    auto *BinOp = dyn_cast<BinaryOperator>(V);
+    if (!BinOp)
+      return false;
+    Value *LHS = BinOp->getOperand(0), *RHS = BinOp->getOperand(1);
+    if (BinOp->getOpcode() == Instruction::Add) {
+      if (IsBase(RHS))
+        std::swap(LHS, RHS);
+      if (!IsBase(LHS))
+        return false;
+      Acc.Steps.push_back({RHS, false});
+      return true;
+    }
+    if (BinOp->getOpcode() == Instruction::Sub && IsBase(LHS)) {
+      Acc.Steps.push_back({RHS, true});
+      return true;
+    }
+    return false;
+  }
+
+  // Whether control can leave L and reach its preheader again
+  static bool canReenter(Loop *L) {
+    SmallVector<BasicBlock *, 4> Exits;
+    L->getExitBlocks(Exits);
+    return llvm::any_of(Exits, [&](BasicBlock *Exit) {
+      return isPotentiallyReachable(Exit, L->getLoopPreheader());
+    });
+  }
+
+  void collectAccumulations() {
+    for (Loop *L : LI.getLoopsInPreorder()) {
+      unsigned TripCount = SE.getSmallConstantMaxTripCount(L);
+      if (!TripCount)
+        continue;
+      for (PHINode &Phi : L->getHeader()->phis()) {
+        if (!Phi.getType()->isIntegerTy())
+          continue;
+        // The header runs at most TripCount times per entry, so the phi
+        // sees at most TripCount - 1 increments
+        Accumulation Acc;
+        Acc.Count = TripCount - 1;
+        bool Matched = true;
+        for (unsigned i = 0, e = Phi.getNumIncomingValues(); i != e; ++i) {
+          Value *Incoming = Phi.getIncomingValue(i);
+          if (!L->contains(Phi.getIncomingBlock(i)))
+            Acc.Inits.push_back(Incoming);
+          else if (!matchIncrement(
+                       Incoming, [&](Value *V) { return V == &Phi; }, Acc))
+            Matched = false;
+        }
+        if (Matched && !Acc.Inits.empty())
+          Accumulations[&Phi] = std::move(Acc);
+      }
+    }
+
+    // A slot incremented directly in the body of a top-level loop with a
+    // preheader, outside any subloop: each such block runs at most once per
+    // iteration, so at most TripCount times per entry, and the loop is
+    // entered at most once per call unless an exit leads back to the
+    // preheader through an irreducible cycle
+    for (auto &Entry : Slots) {
+      AllocaInst *Slot = Entry.first;
+      auto IsSlotLoad = [&](Value *V) {
+        auto *Load = dyn_cast<LoadInst>(V);
+        return Load && Load->getPointerOperand() == Slot;
+      };
+      Accumulation Acc;
+      Loop *Outer = nullptr;
+      unsigned NumIncrements = 0;
+      bool Matched = true;
+      for (StoreInst *Store : Entry.second) {
+        if (!matchIncrement(Store->getValueOperand(), IsSlotLoad, Acc)) {
+          Acc.Inits.push_back(Store->getValueOperand());
+          continue;
+        }
+        Loop *L = LI.getLoopFor(Store->getParent());
+        if (!L || L->getParentLoop() || (Outer && Outer != L))
+          Matched = false;
+        Outer = L;
+        ++NumIncrements;
+      }
+      if (!Matched || !Outer || !Outer->getLoopPreheader() ||
+          Acc.Inits.empty() || canReenter(Outer))
+        continue;
+      if (unsigned TripCount = SE.getSmallConstantMaxTripCount(Outer)) {
+        Acc.Count = uint64_t(NumIncrements) * TripCount;
+        Accumulations[Slot] = std::move(Acc);
+      }
+    }
+  }
+
+  ConstantRange get(Value *V) const {
+    unsigned BitWidth = V->getType()->getIntegerBitWidth();
+    if (auto *ConstInt = dyn_cast<ConstantInt>(V))
+      return ConstantRange(ConstInt->getValue());
+    // Undef and poison may take a different value at each use, so they are
+    // unknown rather than bottom, as in LazyValueInfo without UndefAllowed
+    if (!isa<Instruction>(V))
+      return ConstantRange::getFull(BitWidth);
+    // Instructions not visited yet are bottom
+    auto It = State.find(V);
+    if (It != State.end())
+      return It->second;
+    return ConstantRange::getEmpty(BitWidth);
+  }
+
+  // The range an accumulator can reach, or the full range if the bound does
+  // not fit its width
+  ConstantRange getAccumulationBound(const Accumulation &Acc,
+                                     unsigned BitWidth) const {
+    ConstantRange Base = ConstantRange::getEmpty(BitWidth);
+    for (Value *Init : Acc.Inits)
+      Base = Base.unionWith(get(Init), ConstantRange::Signed);
+    ConstantRange Step = ConstantRange::getEmpty(BitWidth);
+    for (const auto &S : Acc.Steps) {
+      ConstantRange R = get(S.first);
+      if (S.second)
+        R = ConstantRange(APInt::getZero(BitWidth)).sub(R);
+      Step = Step.unionWith(R, ConstantRange::Signed);
+    }
+    if (Base.isEmptySet() || Step.isEmptySet())
+      return Base;
+
+    unsigned Wide = 2 * BitWidth + 64;
+    APInt Count(Wide, Acc.Count);
+    APInt Zero = APInt::getZero(Wide);
+    APInt Lo = Base.getSignedMin().sext(Wide) +
+               APIntOps::smin(Step.getSignedMin().sext(Wide), Zero) * Count;
+    APInt Hi = Base.getSignedMax().sext(Wide) +
+               APIntOps::smax(Step.getSignedMax().sext(Wide), Zero) * Count;
+    if (Lo.slt(APInt::getSignedMinValue(BitWidth).sext(Wide)) ||
+        Hi.sgt(APInt::getSignedMaxValue(BitWidth).sext(Wide)))
+      return ConstantRange::getFull(BitWidth);
+    return ConstantRange::getNonEmpty(Lo.trunc(BitWidth),
+                                      Hi.trunc(BitWidth) + 1);
+  }
+
+  // The transfer function of an integer instruction
+  ConstantRange transfer(Instruction &I) const {
+    unsigned BitWidth = I.getType()->getIntegerBitWidth();
+    if (auto *BinOp = dyn_cast<BinaryOperator>(&I))
+      return get(BinOp->getOperand(0))
+          .binaryOp(BinOp->getOpcode(), get(BinOp->getOperand(1)));
+    if (auto *Cast = dyn_cast<CastInst>(&I)) {
+      if (Cast->getSrcTy()->isIntegerTy())
+        return get(Cast->getOperand(0)).castOp(Cast->getOpcode(), BitWidth);
+      return ConstantRange::getFull(BitWidth);
+    }
+    if (auto *Select = dyn_cast<SelectInst>(&I))
+      return get(Select->getTrueValue())
+          .unionWith(get(Select->getFalseValue()), ConstantRange::Signed);
+    if (auto *Phi = dyn_cast<PHINode>(&I)) {
+      ConstantRange Range = ConstantRange::getEmpty(BitWidth);
+      for (Value *Incoming : Phi->incoming_values())
+        Range = Range.unionWith(get(Incoming), ConstantRange::Signed);
+      return Range;
+    }
+    if (auto *Cmp = dyn_cast<ICmpInst>(&I)) {
+      if (!Cmp->getOperand(0)->getType()->isIntegerTy())
+        return ConstantRange::getFull(BitWidth);
+      ConstantRange LHS = get(Cmp->getOperand(0));
+      ConstantRange RHS = get(Cmp->getOperand(1));
+      if (LHS.isEmptySet() || RHS.isEmptySet())
+        return ConstantRange::getEmpty(BitWidth);
+      if (LHS.icmp(Cmp->getPredicate(), RHS))
+        return ConstantRange(APInt(BitWidth, 1));
+      if (LHS.icmp(Cmp->getInversePredicate(), RHS))
+        return ConstantRange(APInt(BitWidth, 0));
+      return ConstantRange::getFull(BitWidth);
+    }
+    if (auto *Load = dyn_cast<LoadInst>(&I)) {
+      auto *Slot = dyn_cast<AllocaInst>(Load->getPointerOperand());
+      if (Slot && Slots.count(Slot)) {
+        auto It = State.find(Slot);
+        if (It != State.end())
+          return It->second;
+        return ConstantRange::getEmpty(BitWidth);
+      }
+    }
+    if (const MDNode *RangeMD = I.getMetadata(LLVMContext::MD_range))
+      return getConstantRangeFromMetadata(*RangeMD);
+    return ConstantRange::getFull(BitWidth);
+  }
+
+  // The transfer function of V, clamped by its accumulation bound
+  ConstantRange evaluate(Value *V) const {
+    auto *Slot = dyn_cast<AllocaInst>(V);
+    ConstantRange Range =
+        Slot ? ConstantRange::getEmpty(
+                   Slot->getAllocatedType()->getIntegerBitWidth())
+             : transfer(*cast<Instruction>(V));
+    if (Slot) {
+      for (StoreInst *Store : Slots.lookup(Slot))
+        Range = Range.unionWith(get(Store->getValueOperand()),
+                                ConstantRange::Signed);
+    }
+    auto It = Accumulations.find(V);
+    if (It != Accumulations.end())
+      Range = Range.intersectWith(
+          getAccumulationBound(It->second, Range.getBitWidth()),
+          ConstantRange::Signed);
+    return Range;
+  }
+
+  // Joins New into the range of V, widening at widening points. Returns
+  // whether the range grew.
+  bool join(Value *V, const ConstantRange &New, bool IsWideningPoint) {
+    auto Inserted =
+        State.try_emplace(V, ConstantRange::getEmpty(New.getBitWidth()));
+    ConstantRange &Old = Inserted.first->second;
+    ConstantRange Joined = Old.unionWith(New, ConstantRange::Signed);
+    if (Joined == Old)
+      return false;
+    if (IsWideningPoint && !Old.isEmptySet() &&
+        ++Growths[V] > WideningDelay) {
+      unsigned BitWidth = Old.getBitWidth();
+      APInt Lo = Joined.getSignedMin(), Hi = Joined.getSignedMax();
+      if (Lo.slt(Old.getSignedMin()))
+        Lo = APInt::getSignedMinValue(BitWidth);
+      if (Hi.sgt(Old.getSignedMax()))
+        Hi = APInt::getSignedMaxValue(BitWidth);
+      Joined = ConstantRange::getNonEmpty(Lo, Hi + 1);
+      auto It = Accumulations.find(V);
+      if (It != Accumulations.end())
+        Joined = Joined.intersectWith(
+            getAccumulationBound(It->second, BitWidth), ConstantRange::Signed);
+      if (Joined == Old)
+        return false;
+    }
+    Old = Joined;
+    return true;
+  }
+
+  // Calls Visit on every tracked value in evaluation order, with whether it
+  // is a widening point
+  template <typename CallbackT> bool forEachValue(CallbackT Visit) {
+    bool Changed = false;
+    for (BasicBlock *BB : Blocks) {
+      bool IsHeader = LI.isLoopHeader(BB);
+      for (Instruction &I : *BB)
+        if (I.getType()->isIntegerTy())
+          Changed |= Visit(&I, IsHeader && isa<PHINode>(I));
+    }
+    for (auto &Entry : Slots)
+      Changed |= Visit(Entry.first, true);
+    return Changed;
+  }
+
+public:
+  IntervalInterpreter(Function &F, LoopInfo &LI, ScalarEvolution &SE)
+      : F(F), LI(LI), SE(SE) {}
+
+  /**
+   * Computes the ranges and moves them into Result.
+   *
+   * @return false if the ascending passes did not converge within
+   * MaxPasses, in which case nothing is known
+   */
+  bool run(IntervalRanges &Result) {
+    ReversePostOrderTraversal<Function *> RPOT(&F);
+    Blocks.assign(RPOT.begin(), RPOT.end());
+    for (Instruction &I : F.getEntryBlock())
+      if (auto *AI = dyn_cast<AllocaInst>(&I))
+        if (isTrackedSlot(*AI))
+          Slots[AI];
+    for (auto &Entry : Slots)
+      for (User *U : Entry.first->users())
+        if (auto *Store = dyn_cast<StoreInst>(U))
+          Entry.second.push_back(Store);
+    collectAccumulations();
+
+    unsigned Passes = 0;
+    while (forEachValue([&](Value *V, bool IsWideningPoint) {
+      return join(V, evaluate(V), IsWideningPoint);
+    })) {
+      if (++Passes == MaxPasses)
+        return false;
+    }
+
+    // Narrowing keeps a post-fixpoint as long as the transfer functions are
+    // monotone; the result is checked since wrapped ranges are not
+    DenseMap<const Value *, ConstantRange> Ascended = State;
+    for (unsigned i = 0; i < NarrowingPasses; ++i)
+      forEachValue([&](Value *V, bool) {
+        ConstantRange &Range = State.find(V)->second;
+        Range = Range.intersectWith(evaluate(V), ConstantRange::Signed);
+        return false;
+      });
+    if (forEachValue([&](Value *V, bool) {
+          return !State.find(V)->second.contains(evaluate(V));
+        }))
+      State = std::move(Ascended);
+
+    for (const auto &Entry : State)
+      if (!isa<AllocaInst>(Entry.first) && !Entry.second.isFullSet())
+        Result.Ranges->insert({Entry.first, Entry.second});
+    return true;
+  }
+};
+
+// Computes IntervalRanges, on demand, for the functions the pass asks about
+class IntervalRangeAnalysis : public AnalysisInfoMixin<IntervalRangeAnalysis> {
+  friend AnalysisInfoMixin<IntervalRangeAnalysis>;
+  static AnalysisKey Key;
+
+public:
+  using Result = IntervalRanges;
+
+  Result run(Function &F, FunctionAnalysisManager &FAM) {
+    Result Ranges;
+    IntervalInterpreter Interpreter(F, FAM.getResult<LoopAnalysis>(F),
+                                    FAM.getResult<ScalarEvolutionAnalysis>(F));
+    if (!Interpreter.run(Ranges))
+      LLVM_DEBUG(dbgs() << "TypeDowncaster: Interval analysis of "
+                        << F.getName() << " did not converge\n");
+    return Ranges;
+  }
+};
+
+AnalysisKey IntervalRangeAnalysis::Key;
+
+// Which layer of the range oracle produced the tightest range of a value.
+// Combined means that the intersection of several layers was tighter than
+// each of them alone.
+enum class RangeSource {
+  Constant,
+  ScalarEvolution,
+  KnownBits,
+  SignBits,
+  Interprocedural,
+  Interval,
+  Condition,
+  Relational,
+  LazyValueInfo,
+  SMT,
+  Combined
+};
+
+// Ranges known to hold for some values at a program point
+using ValueRangeMap = SmallDenseMap<const Value *, ConstantRange, 8>;
+
+// A comparison between two non-constant integers known to hold
+struct Relation {
+  Value *LHS, *RHS;
+  ICmpInst::Predicate Pred;
+};
+
+// The proofs behind one narrowing decision, recorded in the statistics only
+// once the decision is carried out
+struct ProofLog {
+  SmallVector<RangeSource, 8> Sources;
+  bool ByDemandedBits = false;
+  bool ByErrorBound = false;
+};
+
+// An interval holding a double value and the smallest magnitude the value
+// has when it is not zero. The default bounds know nothing.
+struct FPBounds {
+  double Lo = -HUGE_VAL, Hi = HUGE_VAL;
+  double MinMagnitude = 0;
+
+  bool containsZero() const { return Lo <= 0 && Hi >= 0; }
+  double getMaxMagnitude() const {
+    return std::max(std::fabs(Lo), std::fabs(Hi));
+  }
+};
+
+#ifdef TYPEDOWNCASTER_HAVE_SMT
+// A Z3 context with a cache of answers. Formulas are keyed by their text,
+// in which leaves are numbered in encoding order, so the same expression
+// over the same leaf ranges is only solved once, in whatever function.
+class SMTProver {
+  Z3_context Ctx;
+  StringMap<bool> Results;
+
+public:
+  SMTProver() {
+    Z3_config Config = Z3_mk_config();
+    Z3_set_param_value(Config, "model", "false");
+    Ctx = Z3_mk_context(Config);
+    Z3_del_config(Config);
+  }
+  ~SMTProver() { Z3_del_context(Ctx); }
+  SMTProver(const SMTProver &) = delete;
+  SMTProver &operator=(const SMTProver &) = delete;
+
+  Z3_context getContext() const { return Ctx; }
+
+  // Whether Formula has no model. Timeouts and unknown answers count as
+  // satisfiable.
+  bool isUnsatisfiable(Z3_ast Formula) {
+    std::string Key = Z3_ast_to_string(Ctx, Formula);
+    auto Cached = Results.find(Key);
+    if (Cached != Results.end()) {
+      ++NumSMTCacheHits;
+      return Cached->second;
+    }
+
+    Z3_solver Solver = Z3_mk_solver(Ctx);
+    Z3_solver_inc_ref(Ctx, Solver);
+    Z3_params Params = Z3_mk_params(Ctx);
+    Z3_params_inc_ref(Ctx, Params);
+    Z3_params_set_uint(Ctx, Params, Z3_mk_string_symbol(Ctx, "timeout"),
+                       SMTTimeout);
+    Z3_solver_set_params(Ctx, Solver, Params);
+    Z3_solver_assert(Ctx, Solver, Formula);
+    bool Unsatisfiable = Z3_solver_check(Ctx, Solver) == Z3_L_FALSE;
+    Z3_params_dec_ref(Ctx, Params);
+    Z3_solver_dec_ref(Ctx, Solver);
+
+    ++NumSMTQueries;
+    Results[Key] = Unsatisfiable;
+    return Unsatisfiable;
+  }
+};
+#endif
+
+// Where range queries get their answers from: function analyses on demand,
+// plus the interprocedural facts when the pass runs on a whole module.
+// AssumedArgs asks what could be proven if some arguments were narrower,
+// which is how call-site specialization estimates its gain, and holds the
+// ranges that the call sites of each specialized clone pass.
+// AssumedFloatArgs are double arguments taken to be extended floats.
+struct RangeQuery {
+  FunctionAnalysisManager &FAM;
+  const InterproceduralRanges *IPRanges = nullptr;
+  const ArgumentRangeMap *AssumedArgs = nullptr;
+  const SmallPtrSetImpl<const Argument *> *AssumedFloatArgs = nullptr;
+  // Closure steps the relational domain has spent in each function
+  DenseMap<const Function *, uint64_t> RelationalCost;
+  // Narrowed slots and globals whose stored doubles were rounded; every
+  // later error bound of the run includes them
+  SmallVector<WeakTrackingVH, 4> RoundedObjects;
+#ifdef TYPEDOWNCASTER_HAVE_SMT
+  // Created when the first candidate is handed to the solver
+  std::unique_ptr<SMTProver> Prover;
+#endif
+
+  explicit RangeQuery(FunctionAnalysisManager &FAM,
+                      const InterproceduralRanges *IPRanges = nullptr,
+                      const ArgumentRangeMap *AssumedArgs = nullptr)
+      : FAM(FAM), IPRanges(IPRanges), AssumedArgs(AssumedArgs) {}
+};
+
 struct TypeDowncaster : public PassInfoMixin<TypeDowncaster> {
-  // Data structures to track what we've modified
-  ReplacementTracker Tracker;
+  // Type queries are shared by every function. Replacement state belongs to
+  // each run rather than to the pass, so the pass is reentrant.
+  TypeMappingCache TypeCache;
 
-  bool isEligibleForOptimization(Type *Ty) const {
+  bool isEligibleForOptimization(Type *Ty) {
+    // Scalars are answered directly; only aggregates are worth caching
+    if (!Ty->isAggregateType() && !Ty->isVectorTy())
+      return Ty->isIntegerTy(64) || Ty->isDoubleTy();
+
+    if (Optional<bool> Cached = TypeCache.lookupEligible(Ty))
+      return *Cached;
+
+    bool Eligible = computeEligibility(Ty);
+    TypeCache.recordEligible(Ty, Eligible);
+    return Eligible;
+  }
+
+  bool computeEligibility(Type *Ty) {
     // Check if this is a 64-bit integer that could be 32-bit
     if (Ty->isIntegerTy(64))
       return true;
@@ -146,7 +1027,26 @@ struct TypeDowncaster : public PassInfoMixin<TypeDowncaster> {
     return false;
   }
 
-  Type *getOptimizedType(Type *Ty, LLVMContext &Ctx) const {
+  /**
+   * Returns the narrowed form of Ty, or Ty itself if nothing narrows.
+   *
+   * Results are memoized, so nested aggregates are rebuilt only once per
+   * run. A named struct gets exactly one ".optimized" counterpart no matter
+   * how many slots use it: a later run finds the counterpart in the context.
+   */
+  Type *getOptimizedType(Type *Ty, LLVMContext &Ctx) {
+    if (!Ty->isAggregateType() && !Ty->isVectorTy())
+      return computeOptimizedType(Ty, Ctx);
+
+    if (Type *Cached = TypeCache.lookupOptimized(Ty))
+      return Cached;
+
+    Type *OptimizedTy = computeOptimizedType(Ty, Ctx);
+    TypeCache.recordOptimized(Ty, OptimizedTy);
+    return OptimizedTy;
+  }
+
+  Type *computeOptimizedType(Type *Ty, LLVMContext &Ctx) {
     if (Ty->isIntegerTy(64))
       return Type::getInt32Ty(Ctx);
     
@@ -180,13 +1080,18 @@ struct TypeDowncaster : public PassInfoMixin<TypeDowncaster> {
         Elements.push_back(OptimizedElemTy);
         if (OptimizedElemTy != ElemTy) {
           Modified = true;
-          NumStructFieldsOptimized++;  // Add this line
+          NumStructFieldsOptimized++;
         }
       }
       
       if (Modified) {
         if (StructTy->hasName()) {
           std::string Name = (StructTy->getName() + ".optimized").str();
+          StructType *Existing = StructType::getTypeByName(Ctx, Name);
+          if (Existing && !Existing->isOpaque() &&
+              Existing->isPacked() == StructTy->isPacked() &&
+              Existing->elements() == makeArrayRef(Elements))
+            return Existing;
           return StructType::create(Ctx, Elements, Name, StructTy->isPacked());
         } else {
           return StructType::get(Ctx, Elements, StructTy->isPacked());
@@ -196,343 +1101,3115 @@ struct TypeDowncaster : public PassInfoMixin<TypeDowncaster> {
     
     return Ty;
   }
-  /**
-   * Determines if it's safe to downcast a 64-bit integer value to 32-bit.
-   * 
-   * This function uses ScalarEvolution to perform range analysis on the value.
-   * It checks both constant values and computed ranges to ensure that all
-   * possible values of V can fit within 32 bits without loss of information.
-   * 
-   * The analysis checks:
-   * 1. If the value is a constant, directly check if it fits in 32 bits
-   * 2. If ScalarEvolution can compute a range, check if the entire range fits
-   * 3. For both signed and unsigned interpretations of the value
-   * 
-   * This is a conservative analysis - it will only return true when it can
-   * prove the downcast is safe; otherwise it returns false.
-   * 
-   * @param V The Value to analyze for safe downcasting
-   * @param SE ScalarEvolution analysis results to use for range analysis
-   * @return true if downcasting is guaranteed to be safe, false otherwise
-   */
-  bool isSafeToCast(Value *V, ScalarEvolution &SE) {
-    // If there's a SCEV for this value, try to determine its range
-    if (const SCEV *ValueSCEV = SE.getSCEV(V)) {
-      // If this is a constant, check its value
-      if (const SCEVConstant *ConstSCEV = dyn_cast<SCEVConstant>(ValueSCEV)) {
-        const APInt &Value = ConstSCEV->getValue()->getValue();
-        return Value.isSignedIntN(32);
-      }
-      
-      // If we can compute a range of the SCEV, check if it's within 32 bits
-      ConstantRange Range = SE.getUnsignedRange(ValueSCEV);
-      if (!Range.isFullSet()) {
-        if (Range.getUnsignedMax().isIntN(32) && Range.getUnsignedMin().isIntN(32))
-          return true;
-      }
 
-      Range = SE.getSignedRange(ValueSCEV);
-      if (!Range.isFullSet()) {
-        if (Range.getSignedMax().isIntN(32) && Range.getSignedMin().isIntN(32))
-          return true;
+  // How many dominating blocks are searched for branch conditions, and how
+  // deeply and/or trees of conditions are split
+  static const unsigned MaxDominatingBlocks = 32;
+  static const unsigned MaxConditionDepth = 4;
+
+  // Adds what Cond being IsTrue says about integer values compared with a
+  // constant, and, if Relations is given, the comparisons between two
+  // values. Conjunctions that hold (and disjunctions that fail) are split.
+  static void addConditionFacts(Value *Cond, bool IsTrue, ValueRangeMap &Facts,
+                                SmallVectorImpl<Relation> *Relations,
+                                unsigned Depth = 0) {
+    using namespace PatternMatch;
+    Value *A, *B;
+    if (Depth < MaxConditionDepth) {
+      if (match(Cond, m_Not(m_Value(A))))
+        return addConditionFacts(A, !IsTrue, Facts, Relations, Depth + 1);
+      if (IsTrue ? match(Cond, m_LogicalAnd(m_Value(A), m_Value(B)))
+                 : match(Cond, m_LogicalOr(m_Value(A), m_Value(B)))) {
+        addConditionFacts(A, IsTrue, Facts, Relations, Depth + 1);
+        addConditionFacts(B, IsTrue, Facts, Relations, Depth + 1);
+        return;
       }
     }
 
-    // If this is a constant integer, check if it fits in 32 bits
-    if (ConstantInt *ConstInt = dyn_cast<ConstantInt>(V)) {
-      return ConstInt->getValue().isSignedIntN(32);
+    auto *Cmp = dyn_cast<ICmpInst>(Cond);
+    if (!Cmp || !Cmp->getOperand(0)->getType()->isIntegerTy())
+      return;
+    ICmpInst::Predicate Pred =
+        IsTrue ? Cmp->getPredicate() : Cmp->getInversePredicate();
+    Value *LHS = Cmp->getOperand(0);
+    const APInt *C;
+    if (match(LHS, m_APInt(C))) {
+      LHS = Cmp->getOperand(1);
+      Pred = ICmpInst::getSwappedPredicate(Pred);
+    } else if (!match(Cmp->getOperand(1), m_APInt(C))) {
+      if (Relations)
+        Relations->push_back({LHS, Cmp->getOperand(1), Pred});
+      return;
     }
+    addFact(LHS, ConstantRange::makeAllowedICmpRegion(Pred, ConstantRange(*C)),
+            Facts);
+  }
 
-    // By default, be conservative and assume it's not safe
-    return false;
+  // Records that V lies in Allowed, intersected with what is already known
+  static void addFact(Value *V, const ConstantRange &Allowed,
+                      ValueRangeMap &Facts) {
+    auto Fact = Facts.try_emplace(V, Allowed);
+    if (!Fact.second)
+      Fact.first->second =
+          Fact.first->second.intersectWith(Allowed, ConstantRange::Signed);
   }
 
-  bool isSafeToCastFloat(Value *V) {
-    // If this is a constant, check if it can be precisely represented as float
-    if (ConstantFP *ConstFP = dyn_cast<ConstantFP>(V)) {
-      APFloat DoubleVal = ConstFP->getValueAPF();
-      bool LosesInfo = false;
-      
-      // Convert to float semantics to check precision loss
-      const fltSemantics &FloatSemantics = APFloat::IEEEsingle();
-      DoubleVal.convert(FloatSemantics, APFloat::rmTowardZero, &LosesInfo);
-      
-      return !LosesInfo;
+  /**
+   * Collects the facts that hold at CxtI because of the control flow that
+   * reaches it.
+   *
+   * The dominator tree is walked upwards from the block of CxtI. Whenever a
+   * dominating block ends in a conditional branch or a switch and one of its
+   * outgoing edges dominates CxtI, the condition of that edge holds. The
+   * conditions of llvm.assume calls that are valid at CxtI hold as well;
+   * their operand bundles only carry pointer facts and are ignored.
+   *
+   * @param CxtI The instruction at which the facts are needed
+   * @param Query Provides the dominator tree and the assumption cache
+   * @param Facts Receives the ranges that hold at CxtI
+   * @param Relations If given, receives the comparisons between two values
+   * that hold at CxtI
+   */
+  void collectContextFacts(Instruction *CxtI, RangeQuery &Query,
+                           ValueRangeMap &Facts,
+                           SmallVectorImpl<Relation> *Relations = nullptr) {
+    Function &F = *CxtI->getFunction();
+    DominatorTree &DT = Query.FAM.getResult<DominatorTreeAnalysis>(F);
+    AssumptionCache &AC = Query.FAM.getResult<AssumptionAnalysis>(F);
+
+    BasicBlock *BB = CxtI->getParent();
+    DomTreeNode *Node = DT.getNode(BB);
+    for (unsigned Steps = 0;
+         Node && Node->getIDom() && Steps < MaxDominatingBlocks;
+         Node = Node->getIDom(), ++Steps) {
+      BasicBlock *Dom = Node->getIDom()->getBlock();
+      Instruction *Term = Dom->getTerminator();
+      if (auto *Br = dyn_cast<BranchInst>(Term)) {
+        if (!Br->isConditional())
+          continue;
+        for (unsigned Succ = 0; Succ < 2; ++Succ)
+          if (DT.dominates(BasicBlockEdge(Dom, Br->getSuccessor(Succ)), BB))
+            addConditionFacts(Br->getCondition(), Succ == 0, Facts,
+                              Relations);
+      } else if (auto *Switch = dyn_cast<SwitchInst>(Term)) {
+        for (auto Case : Switch->cases())
+          if (DT.dominates(BasicBlockEdge(Dom, Case.getCaseSuccessor()), BB))
+            addFact(Switch->getCondition(),
+                    ConstantRange(Case.getCaseValue()->getValue()), Facts);
+      }
+    }
+
+    for (auto &Elem : AC.assumptions()) {
+      auto *Assume = cast_or_null<CallInst>(Elem);
+      if (Assume && isValidAssumeForContext(Assume, CxtI, &DT))
+        addConditionFacts(Assume->getArgOperand(0), true, Facts, Relations);
+    }
+  }
+
+  // Evaluates the expression defining V with the context facts applied at
+  // every node; leaves without a fact get their ScalarEvolution range
+  ConstantRange evaluateUnderFacts(Value *V, const ValueRangeMap &Facts,
+                                   ScalarEvolution &SE, unsigned Depth = 0) {
+    unsigned BitWidth = V->getType()->getIntegerBitWidth();
+    if (auto *ConstInt = dyn_cast<ConstantInt>(V))
+      return ConstantRange(ConstInt->getValue());
+
+    ConstantRange Range = ConstantRange::getFull(BitWidth);
+    auto *I = dyn_cast<Instruction>(V);
+    if (I && Depth < InterproceduralRanges::MaxDepth) {
+      if (auto *BinOp = dyn_cast<BinaryOperator>(I)) {
+        Range = evaluateUnderFacts(BinOp->getOperand(0), Facts, SE, Depth + 1)
+                    .binaryOp(BinOp->getOpcode(),
+                              evaluateUnderFacts(BinOp->getOperand(1), Facts,
+                                                 SE, Depth + 1));
+      } else if (auto *Cast = dyn_cast<CastInst>(I)) {
+        if (Cast->getSrcTy()->isIntegerTy())
+          Range = evaluateUnderFacts(Cast->getOperand(0), Facts, SE, Depth + 1)
+                      .castOp(Cast->getOpcode(), BitWidth);
+      }
+    }
+    if (Range.isFullSet() && SE.isSCEVable(V->getType()))
+      Range = SE.getSignedRange(SE.getSCEV(V));
+
+    auto Fact = Facts.find(V);
+    if (Fact != Facts.end())
+      Range = Range.intersectWith(Fact->second, ConstantRange::Signed);
+    return Range;
+  }
+
+  // Width in which differences are computed, wide enough for sums of
+  // bounds of i64 values
+  static const unsigned DifferenceBits = 128;
+
+  // The value a load reads from a slot that is only loaded and stored
+  // directly and has a single store, which dominates the load. The stored
+  // value must be unable to change between the store and the load: an
+  // argument, a constant or an instruction of the storing block. This sees
+  // through the slots that hold parameters and locals in unpromoted IR.
+  static Value *getSingleStoredValue(Value *V, const DominatorTree &DT) {
+    auto *Load = dyn_cast<LoadInst>(V);
+    auto *Slot =
+        Load ? dyn_cast<AllocaInst>(Load->getPointerOperand()) : nullptr;
+    if (!Slot || !Load->isSimple())
+      return nullptr;
+
+    StoreInst *Store = nullptr;
+    for (User *U : Slot->users()) {
+      if (auto *Other = dyn_cast<LoadInst>(U)) {
+        if (!Other->isSimple())
+          return nullptr;
+        continue;
+      }
+      auto *SI = dyn_cast<StoreInst>(U);
+      if (!SI || Store || !SI->isSimple() || SI->getValueOperand() == Slot)
+        return nullptr;
+      Store = SI;
+    }
+    if (!Store || Store->getValueOperand()->getType() != Load->getType() ||
+        !DT.dominates(Store, Load))
+      return nullptr;
+
+    Value *Stored = Store->getValueOperand();
+    auto *StoredI = dyn_cast<Instruction>(Stored);
+    if (isa<Argument>(Stored) || isa<Constant>(Stored) ||
+        (StoredI && StoredI->getParent() == Store->getParent()))
+      return Stored;
+    return nullptr;
+  }
+
+  /**
+   * Bounds the result of Sub with a zone domain of difference constraints.
+   *
+   * The variables are the values compared by Relations and the operands of
+   * Sub, after sign extensions and non-wrapping additions of constants are
+   * split off into offsets and loads of single-store slots are replaced by
+   * the stored value, plus a variable that is always zero and carries the
+   * constant Facts. Each fact and signed or equality relation becomes a
+   * bound on the difference of two variables. The bounds are closed with
+   * Floyd-Warshall, and the bound on the operands of Sub is read off. The
+   * closure costs the cube of the number of variables, which is charged to
+   * the relational budget of the function; once that is spent, the domain
+   * is no longer asked.
+   *
+   * @param Sub The subtraction to bound
+   * @param Facts Ranges of values that hold at the use of Sub
+   * @param Relations Comparisons between values that hold at the use of Sub
+   * @param Query Tracks the closure steps spent per function
+   * @return the range of Sub, or the empty range if the constraints
+   * cannot hold together
+   */
+  ConstantRange getDifferenceRange(BinaryOperator *Sub,
+                                   const ValueRangeMap &Facts,
+                                   ArrayRef<Relation> Relations,
+                                   RangeQuery &Query) {
+    using namespace PatternMatch;
+    unsigned BitWidth = Sub->getType()->getIntegerBitWidth();
+    ConstantRange Full = ConstantRange::getFull(BitWidth);
+    if (BitWidth > 64)
+      return Full;
+    DominatorTree &DT =
+        Query.FAM.getResult<DominatorTreeAnalysis>(*Sub->getFunction());
+
+    // A term is a variable plus an offset; variable 0 is zero
+    SmallVector<Value *, 8> Vars = {nullptr};
+    auto GetTerm = [&](Value *V) -> std::pair<unsigned, APInt> {
+      APInt Offset(DifferenceBits, 0);
+      for (unsigned Depth = 0; Depth < MaxConditionDepth; ++Depth) {
+        Value *X;
+        const APInt *C;
+        if (match(V, m_APInt(C)))
+          return {0, Offset + C->sext(DifferenceBits)};
+        if (match(V, m_SExt(m_Value(X)))) {
+          V = X;
+        } else if (match(V, m_NSWAdd(m_Value(X), m_APInt(C)))) {
+          Offset += C->sext(DifferenceBits);
+          V = X;
+        } else if (match(V, m_NSWSub(m_Value(X), m_APInt(C)))) {
+          Offset -= C->sext(DifferenceBits);
+          V = X;
+        } else if (Value *Stored = getSingleStoredValue(V, DT)) {
+          V = Stored;
+        } else {
+          break;
+        }
+      }
+      auto It = llvm::find(Vars, V);
+      if (It != Vars.end())
+        return {unsigned(It - Vars.begin()), Offset};
+      Vars.push_back(V);
+      return {Vars.size() - 1, Offset};
+    };
+
+    // X[I] - X[J] <= Bound
+    struct Constraint {
+      unsigned I, J;
+      APInt Bound;
+    };
+    SmallVector<Constraint, 16> Constraints;
+    auto One = APInt(DifferenceBits, 1);
+    for (const Relation &R : Relations) {
+      if (R.LHS->getType()->getIntegerBitWidth() > 64 ||
+          (!ICmpInst::isSigned(R.Pred) && R.Pred != ICmpInst::ICMP_EQ))
+        continue;
+      auto A = GetTerm(R.LHS), B = GetTerm(R.RHS);
+      // A.Var + A.Offset Pred B.Var + B.Offset
+      APInt AB = B.second - A.second, BA = A.second - B.second;
+      switch (R.Pred) {
+      case ICmpInst::ICMP_SLT:
+        Constraints.push_back({A.first, B.first, AB - One});
+        break;
+      case ICmpInst::ICMP_SLE:
+        Constraints.push_back({A.first, B.first, AB});
+        break;
+      case ICmpInst::ICMP_SGT:
+        Constraints.push_back({B.first, A.first, BA - One});
+        break;
+      case ICmpInst::ICMP_SGE:
+        Constraints.push_back({B.first, A.first, BA});
+        break;
+      case ICmpInst::ICMP_EQ:
+        Constraints.push_back({A.first, B.first, AB});
+        Constraints.push_back({B.first, A.first, BA});
+        break;
+      default:
+        break;
+      }
+    }
+    auto LHS = GetTerm(Sub->getOperand(0)), RHS = GetTerm(Sub->getOperand(1));
+    for (const auto &Fact : Facts) {
+      if (Fact.second.isEmptySet() || Fact.second.isSignWrappedSet())
+        continue;
+      Value *V = const_cast<Value *>(Fact.first);
+      for (unsigned Depth = 0; Depth < MaxConditionDepth; ++Depth) {
+        Value *Stored = getSingleStoredValue(V, DT);
+        if (!Stored)
+          break;
+        V = Stored;
+      }
+      auto It = llvm::find(Vars, V);
+      if (It == Vars.begin() || It == Vars.end())
+        continue;
+      unsigned I = It - Vars.begin();
+      Constraints.push_back(
+          {I, 0, Fact.second.getSignedMax().sext(DifferenceBits)});
+      Constraints.push_back(
+          {0, I, -Fact.second.getSignedMin().sext(DifferenceBits)});
+    }
+
+    unsigned N = Vars.size();
+    uint64_t Cost = uint64_t(N) * N * N;
+    uint64_t &Spent = Query.RelationalCost[Sub->getFunction()];
+    if (Spent + Cost > RelationalBudget)
+      return Full;
+    Spent += Cost;
+
+    std::vector<Optional<APInt>> Bounds(N * N);
+    for (unsigned I = 0; I < N; ++I)
+      Bounds[I * N + I] = APInt(DifferenceBits, 0);
+    for (const Constraint &C : Constraints) {
+      Optional<APInt> &Bound = Bounds[C.I * N + C.J];
+      if (!Bound || C.Bound.slt(*Bound))
+        Bound = C.Bound;
+    }
+    for (unsigned K = 0; K < N; ++K)
+      for (unsigned I = 0; I < N; ++I)
+        for (unsigned J = 0; J < N; ++J) {
+          const Optional<APInt> &IK = Bounds[I * N + K], &KJ = Bounds[K * N + J];
+          if (!IK || !KJ)
+            continue;
+          APInt Path = *IK + *KJ;
+          Optional<APInt> &IJ = Bounds[I * N + J];
+          if (!IJ || Path.slt(*IJ))
+            IJ = Path;
+        }
+    for (unsigned I = 0; I < N; ++I)
+      if (Bounds[I * N + I]->isNegative())
+        return ConstantRange::getEmpty(BitWidth);
+
+    // Without nsw, the subtraction only equals the difference if both
+    // bounds are known to fit
+    APInt Offset = LHS.second - RHS.second;
+    APInt Min = APInt::getSignedMinValue(BitWidth).sext(DifferenceBits);
+    APInt Max = APInt::getSignedMaxValue(BitWidth).sext(DifferenceBits);
+    const Optional<APInt> &Upper = Bounds[LHS.first * N + RHS.first];
+    const Optional<APInt> &Lower = Bounds[RHS.first * N + LHS.first];
+    APInt Hi = Upper ? *Upper + Offset : Max;
+    APInt Lo = Lower ? Offset - *Lower : Min;
+    if (!Sub->hasNoSignedWrap() &&
+        (!Upper || !Lower || Hi.sgt(Max) || Lo.slt(Min)))
+      return Full;
+    Hi = APIntOps::smin(Hi, Max);
+    Lo = APIntOps::smax(Lo, Min);
+    if (Lo.sgt(Hi))
+      return ConstantRange::getEmpty(BitWidth);
+    return ConstantRange::getNonEmpty(Lo.trunc(BitWidth),
+                                      Hi.trunc(BitWidth) + 1);
+  }
+
+  /**
+   * Computes the signed range of an integer value at one of its uses.
+   *
+   * Constants yield a single-element range without touching any analysis.
+   * Anything else is asked of every layer of the oracle, and since each
+   * answer is sound on its own, their intersection is returned:
+   *  - the global ScalarEvolution range,
+   *  - computeKnownBits and ComputeNumSignBits at CxtI, which see masks,
+   *    extensions and llvm.assume,
+   *  - in module mode, the defining expression evaluated over the
+   *    interprocedural argument and return facts,
+   *  - the interval abstract interpretation of the function, which follows
+   *    data-dependent loops and stack slots that SCEV cannot model,
+   *  - the defining expression evaluated under the branch conditions and
+   *    assumptions that hold at CxtI,
+   *  - for subtractions, the relational domain under the comparisons
+   *    between values that hold at CxtI,
+   *  - LazyValueInfo at CxtI, which adds the conditions of the branches
+   *    that dominate the use.
+   * The analyses of the function containing CxtI are only computed here.
+   *
+   * @param V The integer Value to analyze
+   * @param CxtI The instruction at which V is used
+   * @param Query Analyses and facts that provide the ranges
+   * @param Winner Set to the layer that produced the tightest range
+   * @return a conservative signed range containing every value V can take
+   */
+  ConstantRange getValueRange(Value *V, Instruction *CxtI, RangeQuery &Query,
+                              RangeSource *Winner = nullptr) {
+    if (ConstantInt *ConstInt = dyn_cast<ConstantInt>(V)) {
+      if (Winner)
+        *Winner = RangeSource::Constant;
+      return ConstantRange(ConstInt->getValue());
+    }
+
+    Function &F = *CxtI->getFunction();
+    unsigned BitWidth = V->getType()->getIntegerBitWidth();
+    ConstantRange Range = ConstantRange::getFull(BitWidth);
+    ConstantRange Best = Range;
+    RangeSource BestSource = RangeSource::ScalarEvolution;
+    auto Refine = [&](const ConstantRange &Layer, RangeSource Source) {
+      Range = Range.intersectWith(Layer, ConstantRange::Signed);
+      if (Layer.isSizeStrictlySmallerThan(Best)) {
+        Best = Layer;
+        BestSource = Source;
+      }
+    };
+
+    ScalarEvolution &SE = Query.FAM.getResult<ScalarEvolutionAnalysis>(F);
+    if (SE.isSCEVable(V->getType()))
+      Refine(SE.getSignedRange(SE.getSCEV(V)), RangeSource::ScalarEvolution);
+
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    AssumptionCache &AC = Query.FAM.getResult<AssumptionAnalysis>(F);
+    DominatorTree &DT = Query.FAM.getResult<DominatorTreeAnalysis>(F);
+    KnownBits Known = computeKnownBits(V, DL, 0, &AC, CxtI, &DT);
+    Refine(ConstantRange::fromKnownBits(Known, /*IsSigned=*/true),
+           RangeSource::KnownBits);
+
+    // N sign bits leave BitWidth - N + 1 significant bits
+    unsigned SignBits = ComputeNumSignBits(V, DL, 0, &AC, CxtI, &DT);
+    if (SignBits > 1) {
+      unsigned Significant = BitWidth - SignBits + 1;
+      Refine(ConstantRange(
+                 APInt::getSignedMinValue(Significant).sext(BitWidth),
+                 APInt::getSignedMaxValue(Significant).sext(BitWidth) + 1),
+             RangeSource::SignBits);
+    }
+
+    if (Query.IPRanges)
+      Refine(Query.IPRanges->getRange(V, Query.AssumedArgs),
+             RangeSource::Interprocedural);
+
+    Refine(Query.FAM.getResult<IntervalRangeAnalysis>(F).getRange(V),
+           RangeSource::Interval);
+
+    ValueRangeMap Facts;
+    SmallVector<Relation, 8> Relations;
+    auto *Sub = dyn_cast<BinaryOperator>(V);
+    if (!Sub || Sub->getOpcode() != Instruction::Sub || !RelationalBudget)
+      Sub = nullptr;
+    collectContextFacts(CxtI, Query, Facts, Sub ? &Relations : nullptr);
+    if (!Facts.empty())
+      Refine(evaluateUnderFacts(V, Facts, SE), RangeSource::Condition);
+    if (!Relations.empty())
+      Refine(getDifferenceRange(Sub, Facts, Relations, Query),
+             RangeSource::Relational);
+
+    LazyValueInfo &LVI = Query.FAM.getResult<LazyValueAnalysis>(F);
+    Refine(LVI.getConstantRange(V, CxtI, /*UndefAllowed=*/false),
+           RangeSource::LazyValueInfo);
+
+    if (Winner)
+      *Winner = Range.isSizeStrictlySmallerThan(Best) ? RangeSource::Combined
+                                                      : BestSource;
+    return Range;
+  }
+
+  // Adds the proofs behind a decision that was carried out to the statistics
+  static void recordProofs(const ProofLog &Log) {
+    NumDemandedBitsProofs += Log.ByDemandedBits;
+    NumErrorBoundProofs += Log.ByErrorBound;
+    for (RangeSource Source : Log.Sources) {
+      switch (Source) {
+      case RangeSource::Constant:
+        ++NumRangesFromConstants;
+        break;
+      case RangeSource::ScalarEvolution:
+        ++NumRangesFromSCEV;
+        break;
+      case RangeSource::KnownBits:
+        ++NumRangesFromKnownBits;
+        break;
+      case RangeSource::SignBits:
+        ++NumRangesFromSignBits;
+        break;
+      case RangeSource::Interprocedural:
+        ++NumRangesFromInterprocedural;
+        break;
+      case RangeSource::Interval:
+        ++NumRangesFromIntervals;
+        break;
+      case RangeSource::Condition:
+        ++NumRangesFromConditions;
+        break;
+      case RangeSource::Relational:
+        ++NumRangesFromRelations;
+        break;
+      case RangeSource::LazyValueInfo:
+        ++NumRangesFromLVI;
+        break;
+      case RangeSource::SMT:
+        ++NumRangesFromSMT;
+        break;
+      case RangeSource::Combined:
+        ++NumRangesFromCombination;
+        break;
+      }
+    }
+  }
+
+  /**
+   * Checks whether every value in a signed range survives the round trip
+   * through i32. Narrowed values are sign-extended back on load, so only the
+   * signed interpretation matters.
+   */
+  bool fitsInNarrowedInt(const ConstantRange &Range) const {
+    if (Range.isEmptySet())
+      return true;
+    return Range.getSignedMin().isSignedIntN(32) &&
+           Range.getSignedMax().isSignedIntN(32);
+  }
+
+  /**
+   * Determines if it's safe to downcast a 64-bit integer value to 32-bit.
+   * 
+   * This function uses ScalarEvolution to perform range analysis on the value.
+   * Since narrowed values are sign-extended when read back, the value is safe
+   * to downcast only if its whole signed range fits within 32 bits.
+   * 
+   * This is a conservative analysis - it will only return true when it can
+   * prove the downcast is safe; otherwise it returns false.
+   * 
+   * @param V The Value to analyze for safe downcasting
+   * @param CxtI The instruction at which V is used
+   * @param Query Analyses and facts that provide the ranges
+   * @return true if downcasting is guaranteed to be safe, false otherwise
+   */
+  bool isSafeToCast(Value *V, Instruction *CxtI, RangeQuery &Query) {
+    return fitsInNarrowedInt(getValueRange(V, CxtI, Query)) ||
+           proveFitsBySMT(V, CxtI, Query);
+  }
+
+#ifdef TYPEDOWNCASTER_HAVE_SMT
+  // How many instructions deep, and how many instructions in total, an
+  // expression is encoded for the solver
+  static const unsigned MaxSMTDepth = 8;
+  static const unsigned MaxSMTInstructions = 64;
+
+  struct SMTEncoding {
+    Z3_context Ctx;
+    DenseMap<Value *, Z3_ast> Terms;
+    SmallVector<std::pair<Value *, Z3_ast>, 8> Leaves;
+    unsigned NumInstructions = 0;
+    // Whether some term is used twice or the expression works on bits,
+    // which is where ranges lose precision
+    bool NeedsBits = false;
+  };
+
+  // Encodes V as a bit-vector term. Instructions the encoding does not
+  // model, and everything beyond the depth limit, become leaves. Returns
+  // nullptr for values wider than 64 bits.
+  Z3_ast encodeForSMT(Value *V, Instruction *CxtI, RangeQuery &Query,
+                      SMTEncoding &Enc, unsigned Depth) {
+    auto Cached = Enc.Terms.find(V);
+    if (Cached != Enc.Terms.end()) {
+      Enc.NeedsBits = true;
+      return Cached->second;
+    }
+
+    Z3_context Ctx = Enc.Ctx;
+    unsigned BitWidth = V->getType()->getIntegerBitWidth();
+    if (BitWidth > 64)
+      return nullptr;
+    Z3_sort Sort = Z3_mk_bv_sort(Ctx, BitWidth);
+    auto MakeConstant = [&](const APInt &C) {
+      return Z3_mk_unsigned_int64(Ctx, C.getZExtValue(), Sort);
+    };
+    auto Operand = [&](unsigned i) {
+      return encodeForSMT(cast<Instruction>(V)->getOperand(i), CxtI, Query,
+                          Enc, Depth + 1);
+    };
+
+    Z3_ast Term = nullptr;
+    if (auto *ConstInt = dyn_cast<ConstantInt>(V))
+      return MakeConstant(ConstInt->getValue());
+
+    auto *I = dyn_cast<Instruction>(V);
+    if (I && Depth < MaxSMTDepth &&
+        Enc.NumInstructions++ < MaxSMTInstructions) {
+      if (auto *BinOp = dyn_cast<BinaryOperator>(I)) {
+        Z3_ast LHS = Operand(0), RHS = Operand(1);
+        if (!LHS || !RHS)
+          return nullptr;
+        Enc.NeedsBits |= BinOp->isBitwiseLogicOp() || BinOp->isShift() ||
+                         BinOp->isIntDivRem();
+        switch (BinOp->getOpcode()) {
+        case Instruction::Add: Term = Z3_mk_bvadd(Ctx, LHS, RHS); break;
+        case Instruction::Sub: Term = Z3_mk_bvsub(Ctx, LHS, RHS); break;
+        case Instruction::Mul: Term = Z3_mk_bvmul(Ctx, LHS, RHS); break;
+        case Instruction::And: Term = Z3_mk_bvand(Ctx, LHS, RHS); break;
+        case Instruction::Or: Term = Z3_mk_bvor(Ctx, LHS, RHS); break;
+        case Instruction::Xor: Term = Z3_mk_bvxor(Ctx, LHS, RHS); break;
+        case Instruction::Shl: Term = Z3_mk_bvshl(Ctx, LHS, RHS); break;
+        case Instruction::LShr: Term = Z3_mk_bvlshr(Ctx, LHS, RHS); break;
+        case Instruction::AShr: Term = Z3_mk_bvashr(Ctx, LHS, RHS); break;
+        case Instruction::UDiv: Term = Z3_mk_bvudiv(Ctx, LHS, RHS); break;
+        case Instruction::SDiv: Term = Z3_mk_bvsdiv(Ctx, LHS, RHS); break;
+        case Instruction::URem: Term = Z3_mk_bvurem(Ctx, LHS, RHS); break;
+        case Instruction::SRem: Term = Z3_mk_bvsrem(Ctx, LHS, RHS); break;
+        default: break;
+        }
+      } else if (auto *Cast = dyn_cast<CastInst>(I)) {
+        unsigned SrcWidth = Cast->getSrcTy()->isIntegerTy()
+                                ? Cast->getSrcTy()->getIntegerBitWidth()
+                                : 0;
+        Z3_ast Src = SrcWidth ? Operand(0) : nullptr;
+        if (Src && isa<TruncInst>(Cast))
+          Term = Z3_mk_extract(Ctx, BitWidth - 1, 0, Src);
+        else if (Src && isa<ZExtInst>(Cast))
+          Term = Z3_mk_zero_ext(Ctx, BitWidth - SrcWidth, Src);
+        else if (Src && isa<SExtInst>(Cast))
+          Term = Z3_mk_sign_ext(Ctx, BitWidth - SrcWidth, Src);
+      } else if (isa<SelectInst>(I)) {
+        Z3_ast Cond = Operand(0), T = Operand(1), F = Operand(2);
+        Enc.NeedsBits = true;
+        if (Cond && T && F)
+          Term = Z3_mk_ite(
+              Ctx,
+              Z3_mk_eq(Ctx, Cond,
+                       Z3_mk_unsigned_int64(Ctx, 1, Z3_mk_bv_sort(Ctx, 1))),
+              T, F);
+      } else if (auto *Cmp = dyn_cast<ICmpInst>(I)) {
+        Z3_ast LHS = nullptr, RHS = nullptr;
+        if (Cmp->getOperand(0)->getType()->isIntegerTy()) {
+          LHS = Operand(0);
+          RHS = Operand(1);
+        }
+        Z3_ast Holds = nullptr;
+        if (LHS && RHS) {
+          switch (Cmp->getPredicate()) {
+          case ICmpInst::ICMP_EQ: Holds = Z3_mk_eq(Ctx, LHS, RHS); break;
+          case ICmpInst::ICMP_NE:
+            Holds = Z3_mk_not(Ctx, Z3_mk_eq(Ctx, LHS, RHS));
+            break;
+          case ICmpInst::ICMP_ULT: Holds = Z3_mk_bvult(Ctx, LHS, RHS); break;
+          case ICmpInst::ICMP_ULE: Holds = Z3_mk_bvule(Ctx, LHS, RHS); break;
+          case ICmpInst::ICMP_UGT: Holds = Z3_mk_bvugt(Ctx, LHS, RHS); break;
+          case ICmpInst::ICMP_UGE: Holds = Z3_mk_bvuge(Ctx, LHS, RHS); break;
+          case ICmpInst::ICMP_SLT: Holds = Z3_mk_bvslt(Ctx, LHS, RHS); break;
+          case ICmpInst::ICMP_SLE: Holds = Z3_mk_bvsle(Ctx, LHS, RHS); break;
+          case ICmpInst::ICMP_SGT: Holds = Z3_mk_bvsgt(Ctx, LHS, RHS); break;
+          case ICmpInst::ICMP_SGE: Holds = Z3_mk_bvsge(Ctx, LHS, RHS); break;
+          default: break;
+          }
+        }
+        if (Holds)
+          Term = Z3_mk_ite(Ctx, Holds, MakeConstant(APInt(1, 1)),
+                           MakeConstant(APInt(1, 0)));
+      }
+    }
+
+    if (!Term) {
+      Term = Z3_mk_const(Ctx, Z3_mk_int_symbol(Ctx, Enc.Leaves.size()), Sort);
+      Enc.Leaves.push_back({V, Term});
+    }
+    Enc.Terms[V] = Term;
+    return Term;
+  }
+#endif
+
+  /**
+   * Asks the SMT solver whether V always fits in i32 at CxtI.
+   *
+   * Only used for candidates that every range analysis rejected, and only
+   * with -type-downcaster-smt in builds with Z3. The expression defining V
+   * is encoded bit-precisely down to leaves that carry their ranges, and
+   * the solver looks for leaf values that make V leave the i32 range. The
+   * proof succeeds if there are none; timeouts count as failures.
+   * Expressions of distinct leaves without bitwise operations are left
+   * alone, since interval arithmetic is already as precise for them.
+   *
+   * @param V The i64 Value to prove
+   * @param CxtI The instruction at which V is used
+   * @param Query Ranges of the leaves, and the solver with its cache
+   * @return true if the solver proved that V fits
+   */
+  bool proveFitsBySMT(Value *V, Instruction *CxtI, RangeQuery &Query) {
+#ifdef TYPEDOWNCASTER_HAVE_SMT
+    if (!SMTProofs || !isa<Instruction>(V) || !V->getType()->isIntegerTy(64))
+      return false;
+    if (!Query.Prover)
+      Query.Prover = std::make_unique<SMTProver>();
+    SMTEncoding Enc;
+    Z3_context Ctx = Enc.Ctx = Query.Prover->getContext();
+    Z3_ast Term = encodeForSMT(V, CxtI, Query, Enc, 0);
+    if (!Term || !Enc.NeedsBits)
+      return false;
+
+    SmallVector<Z3_ast, 16> Conjuncts;
+    for (const auto &Leaf : Enc.Leaves) {
+      ConstantRange Range = getValueRange(Leaf.first, CxtI, Query);
+      if (Range.isEmptySet())
+        return false;
+      if (Range.isFullSet() || Range.isSignWrappedSet())
+        continue;
+      Z3_sort Sort = Z3_get_sort(Ctx, Leaf.second);
+      Conjuncts.push_back(Z3_mk_bvsge(
+          Ctx, Leaf.second,
+          Z3_mk_int64(Ctx, Range.getSignedMin().getSExtValue(), Sort)));
+      Conjuncts.push_back(Z3_mk_bvsle(
+          Ctx, Leaf.second,
+          Z3_mk_int64(Ctx, Range.getSignedMax().getSExtValue(), Sort)));
+    }
+
+    // V fits iff sign-extending its low half gives V back
+    Z3_ast Fits = Z3_mk_eq(
+        Ctx, Z3_mk_sign_ext(Ctx, 32, Z3_mk_extract(Ctx, 31, 0, Term)), Term);
+    Conjuncts.push_back(Z3_mk_not(Ctx, Fits));
+    bool Proven = Query.Prover->isUnsatisfiable(
+        Z3_mk_and(Ctx, Conjuncts.size(), Conjuncts.data()));
+    LLVM_DEBUG(if (Proven) dbgs()
+               << "TypeDowncaster: SMT proved that " << *V << " fits\n");
+    return Proven;
+#else
+    return false;
+#endif
+  }
+
+  /**
+   * Bounds the magnitude of a floating-point value that is known to be an
+   * integer, computed exactly by every operation on the way. Integer
+   * conversions take the range of their operand, and sums, differences
+   * and products of such values stay integers; each intermediate result
+   * must stay below 2^53 in double and 2^24 in float, where every integer
+   * is representable, so no operation rounds.
+   *
+   * @return The largest magnitude, or None if the value may not be an
+   *         exactly computed integer
+   */
+  Optional<uint64_t> getExactIntegerMagnitude(Value *V, RangeQuery &Query,
+                                              unsigned Depth = 0) {
+    Type *Ty = V->getType();
+    if (!Ty->isFloatTy() && !Ty->isDoubleTy())
+      return None;
+    uint64_t Limit = uint64_t(1) << APFloat::semanticsPrecision(
+                         Ty->getFltSemantics());
+    auto Bounded = [&](uint64_t Magnitude) -> Optional<uint64_t> {
+      if (Magnitude > Limit)
+        return None;
+      return Magnitude;
+    };
+
+    if (ConstantFP *CF = dyn_cast<ConstantFP>(V)) {
+      const APFloat &F = CF->getValueAPF();
+      if (!F.isInteger())
+        return None;
+      APSInt Int(64, /*isUnsigned=*/false);
+      bool IsExact = false;
+      if (F.convertToInteger(Int, APFloat::rmTowardZero, &IsExact) !=
+              APFloat::opOK ||
+          !IsExact)
+        return None;
+      return Bounded(Int.abs().getZExtValue());
+    }
+
+    Instruction *I = dyn_cast<Instruction>(V);
+    if (!I || Depth >= InterproceduralRanges::MaxDepth)
+      return None;
+
+    auto Operand = [&](unsigned Idx) {
+      return getExactIntegerMagnitude(I->getOperand(Idx), Query, Depth + 1);
+    };
+
+    switch (I->getOpcode()) {
+    case Instruction::SIToFP:
+    case Instruction::UIToFP: {
+      Value *Op = I->getOperand(0);
+      if (!Op->getType()->isIntegerTy() ||
+          Op->getType()->getIntegerBitWidth() > 64)
+        return None;
+      ConstantRange Range = getValueRange(Op, I, Query);
+      if (Range.isEmptySet())
+        return None;
+      APInt Max = I->getOpcode() == Instruction::UIToFP
+                      ? Range.getUnsignedMax()
+                      : APIntOps::umax(Range.getSignedMin().abs(),
+                                       Range.getSignedMax().abs());
+      if (Max.getActiveBits() > 63)
+        return None;
+      return Bounded(Max.getZExtValue());
+    }
+    case Instruction::FPExt:
+    case Instruction::FNeg:
+      return Operand(0);
+    case Instruction::FAdd:
+    case Instruction::FSub: {
+      Optional<uint64_t> A = Operand(0), B = Operand(1);
+      if (!A || !B)
+        return None;
+      return Bounded(*A + *B);
+    }
+    case Instruction::FMul: {
+      Optional<uint64_t> A = Operand(0), B = Operand(1);
+      if (!A || !B || (*A != 0 && *B > Limit / *A))
+        return None;
+      return Bounded(*A * *B);
+    }
+    case Instruction::Select: {
+      Optional<uint64_t> A = Operand(1), B = Operand(2);
+      if (!A || !B)
+        return None;
+      return std::max(*A, *B);
+    }
+    case Instruction::Call:
+      if (auto *II = dyn_cast<IntrinsicInst>(I))
+        if (II->getIntrinsicID() == Intrinsic::fabs)
+          return Operand(0);
+      return None;
+    default:
+      return None;
+    }
+  }
+
+  // A double converts to float exactly if it is a constant that float
+  // represents, a float that was extended, or an exactly computed integer of
+  // at most 2^24 in magnitude
+  bool isSafeToCastFloat(Value *V, RangeQuery &Query) {
+    // If this is a constant, check if it can be precisely represented as float
+    if (ConstantFP *ConstFP = dyn_cast<ConstantFP>(V)) {
+      APFloat DoubleVal = ConstFP->getValueAPF();
+      bool LosesInfo = false;
+      
+      // Convert to float semantics to check precision loss
+      const fltSemantics &FloatSemantics = APFloat::IEEEsingle();
+      DoubleVal.convert(FloatSemantics, APFloat::rmTowardZero, &LosesInfo);
+      
+      return !LosesInfo;
+    }
+
+    if (auto *Ext = dyn_cast<FPExtInst>(V))
+      if (Ext->getSrcTy()->isFloatTy())
+        return true;
+
+    if (auto *Arg = dyn_cast<Argument>(V))
+      if (Query.AssumedFloatArgs && Query.AssumedFloatArgs->count(Arg))
+        return true;
+
+    Optional<uint64_t> Magnitude = getExactIntegerMagnitude(V, Query);
+    return Magnitude && *Magnitude <= (uint64_t(1) << 24);
+  }
+
+  // Host arithmetic on bounds rounds to nearest, so every derived bound is
+  // moved outwards by this relative amount, which also covers the rounding
+  // of the double operation itself
+  static constexpr double BoundSlack = 1.0 / (uint64_t(1) << 50);
+
+  static FPBounds makeFPBounds(double Lo, double Hi, double MinMagnitude) {
+    FPBounds B;
+    if (std::isnan(Lo) || std::isnan(Hi) || std::isnan(MinMagnitude))
+      return B;
+    B.Lo = Lo - std::fabs(Lo) * BoundSlack;
+    B.Hi = Hi + std::fabs(Hi) * BoundSlack;
+    B.MinMagnitude = MinMagnitude * (1 - BoundSlack);
+    if (!B.containsZero())
+      B.MinMagnitude = std::max(B.MinMagnitude,
+                                std::min(std::fabs(B.Lo), std::fabs(B.Hi)));
+    return B;
+  }
+
+  static FPBounds joinFPBounds(const FPBounds &A, const FPBounds &B) {
+    FPBounds J;
+    J.Lo = std::min(A.Lo, B.Lo);
+    J.Hi = std::max(A.Hi, B.Hi);
+    J.MinMagnitude = std::min(A.MinMagnitude, B.MinMagnitude);
+    return J;
+  }
+
+  /**
+   * Bounds a double value by interval arithmetic over the expression that
+   * computes it. Integer conversions take the range of their operand, so
+   * every integer range source contributes; constants are exact. Loads
+   * are only bounded when the caller seeds Cache with them. Everything
+   * else, including values that may be NaN or infinite, is unknown.
+   */
+  FPBounds getFPBounds(Value *V, RangeQuery &Query,
+                       DenseMap<const Value *, FPBounds> &Cache,
+                       unsigned Depth = 0) {
+    if (ConstantFP *CF = dyn_cast<ConstantFP>(V)) {
+      APFloat F = CF->getValueAPF();
+      bool LosesInfo = false;
+      F.convert(APFloat::IEEEdouble(), APFloat::rmNearestTiesToEven,
+                &LosesInfo);
+      double D = F.convertToDouble();
+      if (!std::isfinite(D))
+        return FPBounds();
+      return {D, D, D == 0 ? HUGE_VAL : std::fabs(D)};
+    }
+
+    Instruction *I = dyn_cast<Instruction>(V);
+    if (!I)
+      return FPBounds();
+
+    // Loads of the objects under check are seeded by the caller
+    auto Cached = Cache.find(I);
+    if (Cached != Cache.end())
+      return Cached->second;
+    if (!I->getType()->isDoubleTy() ||
+        Depth >= InterproceduralRanges::MaxDepth)
+      return FPBounds();
+    // A phi that reaches itself sees unknown bounds on the way round
+    Cache[I] = FPBounds();
+
+    auto Operand = [&](unsigned Idx) {
+      return getFPBounds(I->getOperand(Idx), Query, Cache, Depth + 1);
+    };
+
+    FPBounds B;
+    switch (I->getOpcode()) {
+    case Instruction::SIToFP:
+    case Instruction::UIToFP: {
+      Value *Op = I->getOperand(0);
+      if (!Op->getType()->isIntegerTy() ||
+          Op->getType()->getIntegerBitWidth() > 64)
+        break;
+      ConstantRange Range = getValueRange(Op, I, Query);
+      if (Range.isEmptySet())
+        break;
+      bool Signed = I->getOpcode() == Instruction::SIToFP;
+      APInt Min = Signed ? Range.getSignedMin() : Range.getUnsignedMin();
+      APInt Max = Signed ? Range.getSignedMax() : Range.getUnsignedMax();
+      double Lo = Signed ? Min.signedRoundToDouble() : Min.roundToDouble();
+      double Hi = Signed ? Max.signedRoundToDouble() : Max.roundToDouble();
+      // Non-zero integers are at least one in magnitude
+      B = makeFPBounds(Lo, Hi, 1);
+      break;
+    }
+    case Instruction::FPExt:
+      B = Operand(0);
+      break;
+    case Instruction::FNeg: {
+      FPBounds A = Operand(0);
+      B.Lo = -A.Hi;
+      B.Hi = -A.Lo;
+      B.MinMagnitude = A.MinMagnitude;
+      break;
+    }
+    case Instruction::FAdd:
+    case Instruction::FSub: {
+      FPBounds A = Operand(0), C = Operand(1);
+      if (I->getOpcode() == Instruction::FSub)
+        C = {-C.Hi, -C.Lo, C.MinMagnitude};
+      B = makeFPBounds(A.Lo + C.Lo, A.Hi + C.Hi, 0);
+      break;
+    }
+    case Instruction::FMul:
+    case Instruction::FDiv: {
+      FPBounds A = Operand(0), C = Operand(1);
+      bool IsDiv = I->getOpcode() == Instruction::FDiv;
+      if (IsDiv && C.containsZero())
+        break;
+      double Corners[4];
+      for (unsigned K = 0; K < 4; ++K) {
+        double X = K & 1 ? A.Hi : A.Lo, Y = K & 2 ? C.Hi : C.Lo;
+        Corners[K] = IsDiv ? X / Y : X * Y;
+      }
+      double MinMagnitude = IsDiv ? A.MinMagnitude / C.getMaxMagnitude()
+                                  : A.MinMagnitude * C.MinMagnitude;
+      B = makeFPBounds(*std::min_element(Corners, Corners + 4),
+                       *std::max_element(Corners, Corners + 4),
+                       MinMagnitude);
+      break;
+    }
+    case Instruction::Select:
+      B = joinFPBounds(Operand(1), Operand(2));
+      break;
+    case Instruction::PHI: {
+      PHINode *PN = cast<PHINode>(I);
+      for (unsigned K = 0; K < PN->getNumIncomingValues(); ++K) {
+        FPBounds In = Operand(K);
+        B = K == 0 ? In : joinFPBounds(B, In);
+      }
+      break;
+    }
+    default:
+      break;
+    }
+
+    // Bounds that reach infinity say nothing about overflow
+    if (!std::isfinite(B.Lo) || !std::isfinite(B.Hi))
+      B = FPBounds();
+    Cache[I] = B;
+    return B;
+  }
+
+  /**
+   * Bounds the relative error that narrowing some double slots to float
+   * introduces, and checks it against -type-downcaster-fp-tolerance.
+   *
+   * A stored value that is not exactly representable is rounded once; its
+   * bounds must keep it within the normal float range, so the rounding is
+   * relative and neither overflows nor underflows. Loads carry the largest
+   * error stored into their slot, and the error is carried forward through
+   * double arithmetic and from returns into callers until it is stored,
+   * iterating around loops until it settles. Each value must stay
+   * within the tolerance. A sum whose bounds contain zero, a call argument,
+   * a store to memory other than the objects themselves, where the error
+   * could no longer be followed, and any use whose result could change
+   * discretely such as a compare or a conversion to an integer reject the
+   * narrowing.
+   *
+   * Slots and globals narrowed earlier in the run are included through
+   * their float loads and the fptrunc of each stored double, so errors
+   * from several stages add up.
+   *
+   * @param Objects Every slot or global in the stage that rounds doubles,
+   *                including the candidate
+   */
+  bool isWithinErrorBound(ArrayRef<SlotAccesses> Objects, RangeQuery &Query,
+                          StringRef &Reason) {
+    static constexpr double FloatRounding = 1.0 / (uint64_t(1) << 24);
+    static constexpr double DoubleRounding = 1.0 / (uint64_t(1) << 52);
+    static const unsigned MaxRounds = 8;
+
+    SmallVector<SlotAccesses, 8> AllObjects;
+    for (Value *Object : Query.RoundedObjects) {
+      if (!Object)
+        continue;
+      AllObjects.emplace_back();
+      if (!collectSlotAccesses(Object, AllObjects.back(), Reason))
+        return false;
+    }
+    AllObjects.append(Objects.begin(), Objects.end());
+
+    // The double each store writes; narrowed objects store it through an
+    // fptrunc, and their float constants are exact
+    struct ObjectStore {
+      StoreInst *SI;
+      Value *Stored;
+      unsigned Object;
+    };
+    DenseMap<const Value *, FPBounds> Bounds;
+    DenseMap<LoadInst *, unsigned> LoadObjects;
+    SmallVector<ObjectStore, 8> Stores;
+    SmallPtrSet<const Instruction *, 8> ObjectStores;
+    SmallPtrSet<const Instruction *, 8> StoreValues;
+    SmallPtrSet<StoreInst *, 8> RoundedStores;
+    SetVector<Function *> Functions;
+    for (unsigned Idx = 0; Idx < AllObjects.size(); ++Idx) {
+      for (LoadInst *LI : AllObjects[Idx].Loads) {
+        if (LI->getType()->isFloatingPointTy()) {
+          LoadObjects[LI] = Idx;
+          Functions.insert(LI->getFunction());
+        }
+      }
+      for (StoreInst *SI : AllObjects[Idx].Stores) {
+        Value *V = SI->getValueOperand();
+        if (!V->getType()->isFloatingPointTy())
+          continue;
+        if (auto *Trunc = dyn_cast<FPTruncInst>(V)) {
+          if (Trunc->hasOneUse())
+            StoreValues.insert(Trunc);
+          V = Trunc->getOperand(0);
+        }
+        Stores.push_back({SI, V, Idx});
+        ObjectStores.insert(SI);
+      }
+    }
+
+    // Loads are bounded by the join of the values stored into their
+    // object, and of the initializer of a scalar global. The first round
+    // bounds the stored values with every load unknown; each further round
+    // starts from the sound load bounds of the previous one, so objects
+    // stored from loads of other objects are bounded too.
+    static const unsigned MaxBoundRounds = 3;
+    SmallVector<Optional<FPBounds>, 8> InitBounds(AllObjects.size());
+    for (auto &Entry : LoadObjects) {
+      auto *GV = dyn_cast<GlobalVariable>(
+          getUnderlyingObject(Entry.first->getPointerOperand()));
+      if (!GV || InitBounds[Entry.second])
+        continue;
+      Constant *Init = GV->getInitializer();
+      if (Init->isNullValue())
+        InitBounds[Entry.second] = FPBounds{0, 0, HUGE_VAL};
+      else if (isa<ConstantFP>(Init))
+        InitBounds[Entry.second] = getFPBounds(Init, Query, Bounds);
+      else
+        InitBounds[Entry.second] = FPBounds();
+    }
+    for (unsigned Round = 0; Round < MaxBoundRounds; ++Round) {
+      SmallVector<Optional<FPBounds>, 8> ObjectBounds(InitBounds);
+      DenseMap<const Value *, FPBounds> StoredBounds;
+      for (auto &Entry : Bounds)
+        if (isa<LoadInst>(Entry.first))
+          StoredBounds.insert(Entry);
+      for (const ObjectStore &Store : Stores) {
+        FPBounds B = getFPBounds(Store.Stored, Query, StoredBounds);
+        Optional<FPBounds> &Joined = ObjectBounds[Store.Object];
+        Joined = Joined ? joinFPBounds(*Joined, B) : B;
+      }
+      Bounds.clear();
+      for (auto &Entry : LoadObjects)
+        if (ObjectBounds[Entry.second])
+          Bounds[Entry.first] = *ObjectBounds[Entry.second];
+    }
+
+    for (const ObjectStore &Store : Stores) {
+      Value *V = Store.Stored;
+      if (!V->getType()->isDoubleTy() || isSafeToCastFloat(V, Query))
+        continue;
+      FPBounds B = getFPBounds(V, Query, Bounds);
+      if (B.Lo < -FLT_MAX || B.Hi > FLT_MAX || B.MinMagnitude < FLT_MIN) {
+        Reason = "stored double may leave the normal float range";
+        return false;
+      }
+      RoundedStores.insert(Store.SI);
+    }
+
+    SmallVector<double, 4> ObjectErrors(AllObjects.size(), 0.0);
+    DenseMap<const Value *, double> Errors;
+    DenseMap<const Function *, double> ReturnErrors;
+    for (unsigned Round = 0;; ++Round) {
+      if (Round == MaxRounds) {
+        Reason = "rounding error keeps growing around a loop";
+        return false;
+      }
+
+      bool Changed = false;
+      for (const ObjectStore &Store : Stores) {
+        double Error = Errors.lookup(Store.Stored);
+        if (RoundedStores.count(Store.SI))
+          Error = (1 + Error) * (1 + FloatRounding) - 1;
+        if (Error > ObjectErrors[Store.Object]) {
+          ObjectErrors[Store.Object] = Error;
+          Changed = true;
+        }
+      }
+
+      // Callers are added as the error reaches their returns
+      for (unsigned FIdx = 0; FIdx < Functions.size(); ++FIdx) {
+        Function *F = Functions[FIdx];
+        for (BasicBlock *BB : ReversePostOrderTraversal<Function *>(F)) {
+          for (Instruction &I : *BB) {
+            double Error = 0;
+            auto Found = LoadObjects.find(dyn_cast<LoadInst>(&I));
+            if (Found != LoadObjects.end()) {
+              Error = ObjectErrors[Found->second];
+            } else {
+              bool Erroneous = llvm::any_of(I.operands(), [&](Value *Op) {
+                return Errors.lookup(Op) > 0;
+              });
+              auto *CB = dyn_cast<CallBase>(&I);
+              if (!Erroneous && CB && CB->getCalledFunction())
+                Error = ReturnErrors.lookup(CB->getCalledFunction());
+              if (!Erroneous && Error == 0)
+                continue;
+              auto OperandError = [&](unsigned Idx) {
+                return Errors.lookup(I.getOperand(Idx));
+              };
+
+              switch (Erroneous ? I.getOpcode() : 0) {
+              case 0:
+                break;
+              case Instruction::FNeg:
+              case Instruction::FPExt:
+                Error = OperandError(0);
+                break;
+              case Instruction::FPTrunc:
+                // Rounded again where it is stored into a narrowed object
+                if (StoreValues.count(&I))
+                  continue;
+                Reason = "rounded value is truncated";
+                return false;
+              case Instruction::FAdd:
+              case Instruction::FSub: {
+                FPBounds Result = getFPBounds(&I, Query, Bounds);
+                if (Result.containsZero()) {
+                  Reason = "rounded value may cancel in a sum";
+                  return false;
+                }
+                FPBounds A = getFPBounds(I.getOperand(0), Query, Bounds);
+                FPBounds C = getFPBounds(I.getOperand(1), Query, Bounds);
+                Error = (A.getMaxMagnitude() * OperandError(0) +
+                         C.getMaxMagnitude() * OperandError(1)) /
+                            Result.MinMagnitude +
+                        DoubleRounding;
+                break;
+              }
+              case Instruction::FMul:
+                Error = OperandError(0) + OperandError(1) +
+                        OperandError(0) * OperandError(1) + DoubleRounding;
+                break;
+              case Instruction::FDiv:
+                if (OperandError(1) >= 1) {
+                  Reason = "rounding error of a divisor is too large";
+                  return false;
+                }
+                Error = (OperandError(0) + OperandError(1)) /
+                            (1 - OperandError(1)) +
+                        DoubleRounding;
+                break;
+              case Instruction::Select:
+                Error = std::max(OperandError(1), OperandError(2));
+                break;
+              case Instruction::PHI:
+                for (Value *In : cast<PHINode>(I).incoming_values())
+                  Error = std::max(Error, Errors.lookup(In));
+                break;
+              case Instruction::Store:
+                // The loads of the objects carry the error on; anywhere
+                // else it would escape
+                if (ObjectStores.count(&I))
+                  continue;
+                Reason = "rounded value is stored to memory that is not "
+                         "narrowed";
+                return false;
+              case Instruction::Ret: {
+                // Callers see the error of the returned value. Functions
+                // processed on their own do not know the errors of others.
+                if (!Query.IPRanges || !F->hasLocalLinkage() ||
+                    !llvm::all_of(F->users(), [&](User *U) {
+                      auto *CB = dyn_cast<CallBase>(U);
+                      return CB && CB->getCalledOperand() == F;
+                    })) {
+                  Reason = "rounded value is returned to unknown callers";
+                  return false;
+                }
+                double &Returned = ReturnErrors[F];
+                if (OperandError(0) > Returned) {
+                  Returned = OperandError(0);
+                  Changed = true;
+                }
+                for (User *U : F->users())
+                  Functions.insert(cast<CallBase>(U)->getFunction());
+                continue;
+              }
+              case Instruction::Call: {
+                auto *II = dyn_cast<IntrinsicInst>(&I);
+                if (II && II->getIntrinsicID() == Intrinsic::fabs) {
+                  Error = OperandError(0);
+                  break;
+                }
+                if (II && II->getIntrinsicID() == Intrinsic::sqrt) {
+                  Error = OperandError(0) / 2 + DoubleRounding;
+                  break;
+                }
+                Reason = "rounded value is passed to a call";
+                return false;
+              }
+              default:
+                Reason = "rounded value reaches a use that may not tolerate "
+                         "rounding";
+                return false;
+              }
+            }
+
+            if (Error > FPTolerance) {
+              Reason = "rounding error exceeds the tolerance";
+              return false;
+            }
+            double &Known = Errors[&I];
+            if (Error > Known) {
+              Known = Error;
+              Changed = true;
+            }
+          }
+        }
+      }
+
+      if (!Changed)
+        return true;
+    }
+  }
+
+  Value *createCastIfNeeded(IRBuilder<> &Builder, Value *V, Type *DestTy) {
+    if (V->getType() == DestTy)
+      return V;
+      
+    if (DestTy->isIntegerTy() && V->getType()->isIntegerTy()) {
+      if (DestTy->getIntegerBitWidth() > V->getType()->getIntegerBitWidth())
+        return Builder.CreateSExt(V, DestTy);
+      else
+        return Builder.CreateTrunc(V, DestTy);
+    }
+    
+    if (DestTy->isDoubleTy() && V->getType()->isFloatTy())
+      return Builder.CreateFPExt(V, DestTy);
+    if (DestTy->isFloatTy() && V->getType()->isDoubleTy())
+      return Builder.CreateFPTrunc(V, DestTy);
+
+    // Handle pointer types
+    if (DestTy->isPointerTy() && V->getType()->isPointerTy())
+      return Builder.CreateBitCast(V, DestTy);
+
+    // Default case - bitcast if possible or return nullptr
+    if (CastInst::isBitCastable(V->getType(), DestTy))
+      return Builder.CreateBitCast(V, DestTy);
+
+    return nullptr;
+  }
+
+  /**
+   * Checks that an access of type AccessTy can be retargeted to a narrowed
+   * slot. Only scalar i64/double accesses are converted; accesses of types
+   * that are not narrowed are copied as-is.
+   */
+  bool isNarrowableAccess(Type *AccessTy, bool IsVolatile, StringRef &Reason) {
+    if (IsVolatile) {
+      Reason = "volatile access";
+      return false;
+    }
+
+    if (isEligibleForOptimization(AccessTy) && !AccessTy->isIntegerTy(64) &&
+        !AccessTy->isDoubleTy()) {
+      Reason = "whole-aggregate or vector access";
+      return false;
+    }
+
+    return true;
+  }
+
+  /**
+   * Collects every load and store that reaches Base, following GEP chains.
+   *
+   * Fails if the address is used by anything the rewriter cannot retarget to
+   * the narrowed slot, such as a call, a cast or a store of the address itself.
+   *
+   * @param Base The slot (alloca or global) whose accesses are collected
+   * @param Accesses Receives the loads and stores of the slot
+   * @param Reason Set to a short explanation when collection fails
+   * @return true if all uses of the slot are understood
+   */
+  bool collectSlotAccesses(Value *Base, SlotAccesses &Accesses, StringRef &Reason) {
+    SmallVector<Value *, 8> WorkList;
+    WorkList.push_back(Base);
+
+    while (!WorkList.empty()) {
+      Value *Ptr = WorkList.pop_back_val();
+
+      for (User *U : Ptr->users()) {
+        if (LoadInst *LI = dyn_cast<LoadInst>(U)) {
+          if (!isNarrowableAccess(LI->getType(), LI->isVolatile(), Reason))
+            return false;
+          Accesses.Loads.push_back(LI);
+        } else if (StoreInst *SI = dyn_cast<StoreInst>(U)) {
+          if (SI->getValueOperand() == Ptr) {
+            Reason = "address is stored to memory";
+            return false;
+          }
+          if (!isNarrowableAccess(SI->getValueOperand()->getType(),
+                                  SI->isVolatile(), Reason))
+            return false;
+          Accesses.Stores.push_back(SI);
+        } else if (isa<GEPOperator>(U)) {
+          WorkList.push_back(U);
+        } else {
+          Reason = "address escapes";
+          return false;
+        }
+      }
+    }
+
+    return true;
+  }
+
+  /**
+   * Checks with DemandedBits that no user of an i64 value observes any of
+   * its upper 32 bits. Such a value may be replaced by any value with the
+   * same low half, whatever its range.
+   */
+  bool isOnlyLowHalfDemanded(Instruction *I, RangeQuery &Query) {
+    if (!I->getType()->isIntegerTy(64))
+      return false;
+    DemandedBits &DB =
+        Query.FAM.getResult<DemandedBitsAnalysis>(*I->getFunction());
+    return DB.getDemandedBits(I).countLeadingZeros() >= 32;
+  }
+
+  /**
+   * Proves that every value stored into a candidate slot survives the round
+   * trip through its narrowed type, as far as any load can tell.
+   *
+   * The ranges of all integer stores are joined into one signed range that
+   * must fit in i32. When it does not, the slot can still be narrowed if no
+   * i64 load of it has its upper 32 bits observed, which DemandedBits
+   * decides per load. Floating-point stores must convert to float exactly,
+   * unless a tolerance is set and the rounding error of this slot, together
+   * with that of the slots already narrowed, stays within it.
+   * Stores and loads may come from several functions; each is analyzed in
+   * its own function.
+   *
+   * @param Log Receives the proofs when the slot can be narrowed
+   * @param RoundingSlots The slots of this stage that round doubles; the
+   *                      slot is added when it is accepted by the error
+   *                      bound. Without it, inexact doubles are rejected.
+   */
+  bool areStoredValuesNarrowable(
+      const SlotAccesses &Accesses, RangeQuery &Query, StringRef &Reason,
+      ProofLog *Log = nullptr,
+      SmallVectorImpl<SlotAccesses> *RoundingSlots = nullptr) {
+    ConstantRange Joined = ConstantRange::getEmpty(64);
+    SmallVector<RangeSource, 8> Sources;
+    bool RoundsDoubles = false;
+
+    for (StoreInst *SI : Accesses.Stores) {
+      Value *V = SI->getValueOperand();
+      Type *Ty = V->getType();
+
+      if (Ty->isIntegerTy(64)) {
+        RangeSource Source;
+        ConstantRange Range = getValueRange(V, SI, Query, &Source);
+        if (!fitsInNarrowedInt(Range) && proveFitsBySMT(V, SI, Query)) {
+          Range = ConstantRange::getNonEmpty(
+              APInt::getSignedMinValue(32).sext(64),
+              APInt::getSignedMaxValue(32).sext(64) + 1);
+          Source = RangeSource::SMT;
+        }
+        Joined = Joined.unionWith(Range, ConstantRange::Signed);
+        Sources.push_back(Source);
+      } else if (Ty->isDoubleTy() && !isSafeToCastFloat(V, Query)) {
+        if (!RoundingSlots || FPTolerance <= 0) {
+          Reason = "stored double is not exactly representable as float";
+          return false;
+        }
+        RoundsDoubles = true;
+      }
+    }
+
+    bool ByDemandedBits = false;
+    if (!fitsInNarrowedInt(Joined)) {
+      ByDemandedBits = llvm::all_of(Accesses.Loads, [&](LoadInst *LI) {
+        return !LI->getType()->isIntegerTy(64) ||
+               isOnlyLowHalfDemanded(LI, Query);
+      });
+      if (!ByDemandedBits) {
+        Reason = "joined range of stored values does not fit in i32";
+        return false;
+      }
+    }
+
+    if (RoundsDoubles) {
+      RoundingSlots->push_back(Accesses);
+      if (!isWithinErrorBound(*RoundingSlots, Query, Reason)) {
+        RoundingSlots->pop_back();
+        return false;
+      }
+    }
+
+    if (Log) {
+      if (!ByDemandedBits)
+        Log->Sources.append(Sources.begin(), Sources.end());
+      Log->ByDemandedBits = ByDemandedBits;
+      Log->ByErrorBound = RoundsDoubles;
+    }
+    return true;
+  }
+
+  // Concatenates module-level and call-site inline assembly, which may refer
+  // to globals by symbol name without any visible use in the IR
+  std::string collectInlineAsmText(Module &M) const {
+    std::string AsmText = M.getModuleInlineAsm();
+    for (auto &F : M) {
+      for (auto &BB : F) {
+        for (auto &I : BB) {
+          if (CallBase *CB = dyn_cast<CallBase>(&I)) {
+            if (InlineAsm *IA = dyn_cast<InlineAsm>(CB->getCalledOperand())) {
+              AsmText += '\n';
+              AsmText += IA->getAsmString();
+            }
+          }
+        }
+      }
+    }
+    return AsmText;
+  }
+
+  // Whether the assembly names the symbol as a whole identifier. Unnamed
+  // globals get a private temporary symbol that assembly cannot refer to.
+  static bool isNamedInAsm(StringRef AsmText, StringRef Name) {
+    if (Name.empty())
+      return false;
+    auto IsIdentifierChar = [](char C) {
+      return isAlnum(C) || C == '_' || C == '.' || C == '$';
+    };
+    for (size_t Pos = AsmText.find(Name); Pos != StringRef::npos;
+         Pos = AsmText.find(Name, Pos + 1)) {
+      size_t End = Pos + Name.size();
+      if ((Pos == 0 || !IsIdentifierChar(AsmText[Pos - 1])) &&
+          (End == AsmText.size() || !IsIdentifierChar(AsmText[End])))
+        return true;
+    }
+    return false;
+  }
+
+  // Whether module-level or call-site assembly names the global. Assembly
+  // refers to the emitted symbol, which the Mangler derives from the IR name
+  // with the global or private prefix of the target (such as "_g" for @g on
+  // Mach-O). The IR name is searched as well, so assembly that mentions the
+  // global in any form keeps it wide.
+  static bool isGlobalNamedInAsm(StringRef AsmText, const GlobalVariable &GV) {
+    if (AsmText.empty() || !GV.hasName())
+      return false;
+    SmallString<64> Symbol;
+    Mangler().getNameWithPrefix(Symbol, &GV, /*CannotUsePrivateLabel=*/false);
+    return isNamedInAsm(AsmText, Symbol) ||
+           isNamedInAsm(AsmText, GV.getName());
+  }
+
+  /**
+   * Checks whether a global can be observed outside the IR that this pass
+   * rewrites.
+   *
+   * Narrowing changes the layout of the symbol, so it is only sound when
+   * every reader and writer is visible here: the global must have local
+   * linkage, must not be kept alive through llvm.used or
+   * llvm.compiler.used, must not be named from inline assembly by its
+   * symbol, and must not be initialized or placed by the loader.
+   * Address-taken uses are rejected later by collectSlotAccesses.
+   */
+  bool doesGlobalEscape(GlobalVariable *GV,
+                        const SmallPtrSetImpl<GlobalValue *> &UsedGlobals,
+                        StringRef InlineAsmText, StringRef &Reason) const {
+    if (!GV->hasLocalLinkage()) {
+      Reason = "externally visible";
+      return true;
+    }
+
+    if (UsedGlobals.count(GV)) {
+      Reason = "listed in llvm.used";
+      return true;
+    }
+
+    if (GV->isExternallyInitialized()) {
+      Reason = "externally initialized";
+      return true;
+    }
+
+    if (GV->hasSection()) {
+      Reason = "placed in an explicit section";
+      return true;
+    }
+
+    if (isGlobalNamedInAsm(InlineAsmText, *GV)) {
+      Reason = "referenced from inline assembly";
+      return true;
     }
 
-    // For variables, be conservative about float precision
     return false;
   }
 
-  Value *createCastIfNeeded(IRBuilder<> &Builder, Value *V, Type *DestTy) {
-    if (V->getType() == DestTy)
-      return V;
-      
-    if (DestTy->isIntegerTy() && V->getType()->isIntegerTy()) {
-      if (DestTy->getIntegerBitWidth() > V->getType()->getIntegerBitWidth())
-        return Builder.CreateSExt(V, DestTy);
-      else
-        return Builder.CreateTrunc(V, DestTy);
+  /**
+   * Decides whether a global can be narrowed by looking at the whole module.
+   *
+   * Every store to the global is gathered, including stores in other
+   * functions and through constant GEP expressions, and the ranges of the
+   * stored values are joined, each analyzed in the storing function. The
+   * initializer is checked separately when it is converted.
+   */
+  bool isSafeToNarrowGlobal(GlobalVariable *GV, RangeQuery &Query,
+                            StringRef &Reason, ProofLog &Log,
+                            SmallVectorImpl<SlotAccesses> &RoundingSlots) {
+    SlotAccesses Accesses;
+    if (!collectSlotAccesses(GV, Accesses, Reason))
+      return false;
+    return areStoredValuesNarrowable(Accesses, Query, Reason, &Log,
+                                     &RoundingSlots);
+  }
+
+  bool optimizeAlloca(AllocaInst *Alloca, LLVMContext &Ctx, Function &F,
+                      ReplacementTracker &Tracker) {
+    Type *AllocaTy = Alloca->getAllocatedType();
+    Type *OptimizedTy = getOptimizedType(AllocaTy, Ctx);
+    
+    // Nothing to optimize
+    if (OptimizedTy == AllocaTy)
+      return false;
+
+    // Create a new alloca with the smaller type
+    IRBuilder<> Builder(Alloca);
+    AllocaInst *NewAlloca = Builder.CreateAlloca(OptimizedTy, Alloca->getArraySize(),
+                                                Alloca->getName() + ".optimized");
+    NewAlloca->setAlignment(Alloca->getAlign());
+    
+    // Record this replacement
+    Tracker.addAllocaReplacement(Alloca, NewAlloca);
+    
+    unsigned OriginalSize = F.getParent()->getDataLayout().getTypeAllocSize(AllocaTy);
+    unsigned OptimizedSize = F.getParent()->getDataLayout().getTypeAllocSize(OptimizedTy);
+    NumTotalBytesReduced += (OriginalSize - OptimizedSize);
+
+    if (AllocaTy->isDoubleTy() && OptimizedTy->isFloatTy()) {
+      ++NumFloatToFloatOptimized;
+    }
+    
+    return true;
+  }
+
+  /**
+   * Converts a global initializer to the narrowed type.
+   *
+   * The narrowed global replaces the original outright, so the converted
+   * initializer must hold exactly the same values. Arrays, structs and
+   * vectors are converted element by element, and elements whose type is
+   * not narrowed are kept as they are. Returns nullptr if any element cannot
+   * be converted without loss.
+   */
+  Constant *convertInitializer(Constant *Init, Type *OptimizedTy) {
+    if (Init->getType() == OptimizedTy)
+      return Init;
+
+    if (Init->isNullValue())
+      return Constant::getNullValue(OptimizedTy);
+
+    if (isa<PoisonValue>(Init))
+      return PoisonValue::get(OptimizedTy);
+
+    if (isa<UndefValue>(Init))
+      return UndefValue::get(OptimizedTy);
+
+    if (ConstantInt *CI = dyn_cast<ConstantInt>(Init)) {
+      if (!OptimizedTy->isIntegerTy(32) || !CI->getValue().isSignedIntN(32))
+        return nullptr;
+      return ConstantInt::get(OptimizedTy, CI->getValue().trunc(32));
+    }
+
+    if (ConstantFP *CF = dyn_cast<ConstantFP>(Init)) {
+      if (!OptimizedTy->isFloatTy())
+        return nullptr;
+      APFloat NewFloat = CF->getValueAPF();
+      bool LosesInfo = false;
+      NewFloat.convert(APFloat::IEEEsingle(), APFloat::rmNearestTiesToEven,
+                       &LosesInfo);
+      if (LosesInfo)
+        return nullptr;
+      return ConstantFP::get(OptimizedTy, NewFloat);
+    }
+
+    if (ConstantDataSequential *CDS = dyn_cast<ConstantDataSequential>(Init)) {
+      Constant *Converted = nullptr;
+      if (convertDataSequential(CDS, OptimizedTy, Converted))
+        return Converted;
+    }
+
+    if (isa<ConstantAggregate>(Init) || isa<ConstantDataSequential>(Init))
+      return convertAggregateInitializer(Init, OptimizedTy);
+
+    // Constant expressions and anything else cannot be proven exact
+    return nullptr;
+  }
+
+  /**
+   * Bulk conversion of i64/double ConstantDataArray and ConstantDataVector
+   * initializers.
+   *
+   * Works directly on the raw element buffer: one tight loop narrows every
+   * element into a new buffer while accumulating an exactness flag, so the
+   * host compiler can vectorize it and no per-element APInt/APFloat or
+   * Constant is created. The narrowed constant is built from the new buffer.
+   *
+   * Returns false when the buffer has to go through the element-wise path
+   * instead: unsupported element types, and NaNs, whose payloads the ==
+   * check here cannot judge. Otherwise Result is set to the converted
+   * constant, or to nullptr if some element is not exactly representable.
+   */
+  bool convertDataSequential(ConstantDataSequential *CDS, Type *OptimizedTy,
+                             Constant *&Result) {
+    Type *ElemTy = CDS->getElementType();
+    Type *OptimizedElemTy = OptimizedTy->getContainedType(0);
+    uint64_t NumElements = CDS->getNumElements();
+    const char *Src = CDS->getRawDataValues().data();
+
+    std::vector<char> Narrowed;
+    if (ElemTy->isIntegerTy(64) && OptimizedElemTy->isIntegerTy(32)) {
+      Narrowed.resize(NumElements * sizeof(int32_t));
+      int32_t *Dst = reinterpret_cast<int32_t *>(Narrowed.data());
+      bool Exact = true;
+      for (uint64_t i = 0; i < NumElements; ++i) {
+        int64_t Wide;
+        std::memcpy(&Wide, Src + i * sizeof(int64_t), sizeof(int64_t));
+        Dst[i] = static_cast<int32_t>(Wide);
+        Exact &= (static_cast<int64_t>(Dst[i]) == Wide);
+      }
+      if (!Exact)
+        return true;
+    } else if (ElemTy->isDoubleTy() && OptimizedElemTy->isFloatTy()) {
+      Narrowed.resize(NumElements * sizeof(float));
+      float *Dst = reinterpret_cast<float *>(Narrowed.data());
+      bool Exact = true;
+      bool HasNaN = false;
+      for (uint64_t i = 0; i < NumElements; ++i) {
+        double Wide;
+        std::memcpy(&Wide, Src + i * sizeof(double), sizeof(double));
+        // Converting a finite double beyond the float range is undefined,
+        // so such elements are replaced by 0, which fails the exactness check
+        bool OutOfRange = std::fabs(Wide) > FLT_MAX && !std::isinf(Wide);
+        Dst[i] = static_cast<float>(OutOfRange ? 0.0 : Wide);
+        Exact &= !OutOfRange && (static_cast<double>(Dst[i]) == Wide);
+        HasNaN |= (Wide != Wide);
+      }
+      if (HasNaN)
+        return false;
+      if (!Exact)
+        return true;
+    } else {
+      return false;
+    }
+
+    StringRef Data(Narrowed.data(), Narrowed.size());
+    if (OptimizedTy->isArrayTy())
+      Result = ConstantDataArray::getRaw(Data, NumElements, OptimizedElemTy);
+    else
+      Result = ConstantDataVector::getRaw(Data, NumElements, OptimizedElemTy);
+    return true;
+  }
+
+  Constant *convertAggregateInitializer(Constant *Init, Type *OptimizedTy) {
+    unsigned NumElements;
+    if (StructType *StructTy = dyn_cast<StructType>(OptimizedTy))
+      NumElements = StructTy->getNumElements();
+    else if (ArrayType *ArrayTy = dyn_cast<ArrayType>(OptimizedTy))
+      NumElements = ArrayTy->getNumElements();
+    else if (FixedVectorType *VecTy = dyn_cast<FixedVectorType>(OptimizedTy))
+      NumElements = VecTy->getNumElements();
+    else
+      return nullptr;
+
+    SmallVector<Constant *, 16> Elements;
+    Elements.reserve(NumElements);
+    for (unsigned i = 0; i < NumElements; ++i) {
+      Constant *Elem = Init->getAggregateElement(i);
+      Type *OptimizedElemTy = OptimizedTy->isStructTy()
+                                  ? OptimizedTy->getStructElementType(i)
+                                  : OptimizedTy->getContainedType(0);
+      Constant *NewElem = Elem ? convertInitializer(Elem, OptimizedElemTy) : nullptr;
+      if (!NewElem)
+        return nullptr;
+      Elements.push_back(NewElem);
+    }
+
+    if (StructType *StructTy = dyn_cast<StructType>(OptimizedTy))
+      return ConstantStruct::get(StructTy, Elements);
+    if (ArrayType *ArrayTy = dyn_cast<ArrayType>(OptimizedTy))
+      return ConstantArray::get(ArrayTy, Elements);
+    return ConstantVector::get(Elements);
+  }
+
+  bool optimizeGlobal(GlobalVariable *GV, Module &M, ReplacementTracker &Tracker) {
+    Type *GVType = GV->getValueType();
+    Type *OptimizedTy = getOptimizedType(GVType, M.getContext());
+    
+    if (OptimizedTy == GVType)
+      return false;
+
+    Constant *NewInit = nullptr;
+    if (GV->hasInitializer()) {
+      NewInit = convertInitializer(GV->getInitializer(), OptimizedTy);
+      if (!NewInit) {
+        LLVM_DEBUG(dbgs() << "  Kept global wide (initializer is not exact): "
+                          << GV->getName() << "\n");
+        return false;
+      }
+    }
+
+    // Create new global with the optimized type next to the original. It
+    // takes over the name once the original is deleted.
+    GlobalVariable *NewGV = new GlobalVariable(
+        M, OptimizedTy, GV->isConstant(), GV->getLinkage(),
+        NewInit, GV->getName() + ".optimized", GV,
+        GV->getThreadLocalMode(), GV->getAddressSpace());
+
+    // Copy everything else: visibility, unnamed_addr, alignment, section,
+    // comdat, attributes and metadata. The !dbg variables describe the wide
+    // type and would make debuggers read past the narrowed object, so they
+    // are dropped and the variable shows as optimized out.
+    NewGV->copyAttributesFrom(GV);
+    NewGV->setComdat(GV->getComdat());
+    SmallVector<std::pair<unsigned, MDNode *>, 4> MDs;
+    GV->getAllMetadata(MDs);
+    for (auto &MD : MDs)
+      if (MD.first != LLVMContext::MD_dbg)
+        NewGV->addMetadata(MD.first, *MD.second);
+    
+    Tracker.addGlobalReplacement(GV, NewGV);
+
+    unsigned OriginalSize = M.getDataLayout().getTypeAllocSize(GVType);
+    unsigned OptimizedSize = M.getDataLayout().getTypeAllocSize(OptimizedTy);
+    NumTotalBytesReduced += (OriginalSize - OptimizedSize);
+
+    if (GVType->isDoubleTy() && OptimizedTy->isFloatTy()) {
+      ++NumFloatToFloatOptimized;
+    }
+
+    return true;
+  }
+
+  // Narrowed fields sit at smaller offsets, so keep no more alignment than
+  // the narrowed type guarantees
+  Align getNarrowedAccessAlign(Align OriginalAlign, Type *NewTy,
+                               const DataLayout &DL) const {
+    return std::min(OriginalAlign, DL.getABITypeAlign(NewTy));
+  }
+
+  void rewriteLoad(LoadInst *LI, Value *NewPtr, ReplacementTracker &Tracker) {
+    IRBuilder<> Builder(LI);
+    const DataLayout &DL = LI->getModule()->getDataLayout();
+
+    Type *OriginalType = LI->getType();
+    Type *NewPtrElemTy = NewPtr->getType()->getPointerElementType();
+
+    // Create load from the new memory location
+    LoadInst *NewLoad = Builder.CreateLoad(NewPtrElemTy, NewPtr, LI->getName() + ".downcasted");
+    NewLoad->setAlignment(getNarrowedAccessAlign(LI->getAlign(), NewPtrElemTy, DL));
+    NewLoad->setVolatile(LI->isVolatile());
+    NewLoad->setOrdering(LI->getOrdering());
+
+    // Cast back to the original type if needed
+    Value *Result = createCastIfNeeded(Builder, NewLoad, OriginalType);
+
+    if (Result) {
+      LI->replaceAllUsesWith(Result);
+      Tracker.markForRemoval(LI);
+    }
+  }
+
+  void rewriteStore(StoreInst *SI, Value *NewPtr, ReplacementTracker &Tracker) {
+    IRBuilder<> Builder(SI);
+    const DataLayout &DL = SI->getModule()->getDataLayout();
+
+    Value *ValToStore = SI->getValueOperand();
+    Type *NewPtrElemTy = NewPtr->getType()->getPointerElementType();
+
+    // Cast the value to the new type if needed
+    Value *NewValToStore = createCastIfNeeded(Builder, ValToStore, NewPtrElemTy);
+
+    if (NewValToStore) {
+      // Create store to the new memory location
+      StoreInst *NewStore = Builder.CreateStore(NewValToStore, NewPtr);
+      NewStore->setAlignment(getNarrowedAccessAlign(SI->getAlign(), NewPtrElemTy, DL));
+      NewStore->setVolatile(SI->isVolatile());
+      NewStore->setOrdering(SI->getOrdering());
+
+      Tracker.markForRemoval(SI);
+    }
+  }
+
+  /**
+   * Retargets every access of OldBase to NewBase by walking use lists.
+   *
+   * GEPs, both instructions and constant expressions, are recreated on the
+   * narrowed type and followed transitively, so each user is rewritten
+   * exactly once no matter which function it lives in. The replaced loads,
+   * stores and GEP instructions are queued for removal.
+   */
+  void rewriteSlotUses(Value *OldBase, Value *NewBase,
+                       ReplacementTracker &Tracker) {
+    SmallVector<std::pair<Value *, Value *>, 8> WorkList;
+    WorkList.push_back({OldBase, NewBase});
+
+    while (!WorkList.empty()) {
+      Value *OldPtr = WorkList.back().first;
+      Value *NewPtr = WorkList.back().second;
+      WorkList.pop_back();
+
+      for (User *U : OldPtr->users()) {
+        if (LoadInst *LI = dyn_cast<LoadInst>(U)) {
+          rewriteLoad(LI, NewPtr, Tracker);
+        } else if (StoreInst *SI = dyn_cast<StoreInst>(U)) {
+          rewriteStore(SI, NewPtr, Tracker);
+        } else if (GEPOperator *GEP = dyn_cast<GEPOperator>(U)) {
+          Type *NewElemTy = NewPtr->getType()->getPointerElementType();
+          SmallVector<Value *, 4> Indices(GEP->idx_begin(), GEP->idx_end());
+          Value *NewGEP;
+
+          if (GetElementPtrInst *GEPInst = dyn_cast<GetElementPtrInst>(GEP)) {
+            IRBuilder<> Builder(GEPInst);
+            NewGEP = Builder.CreateGEP(NewElemTy, NewPtr, Indices,
+                                       GEPInst->getName() + ".optimized");
+            Tracker.markForRemoval(GEPInst);
+          } else {
+            SmallVector<Constant *, 4> ConstIndices;
+            for (Value *Idx : Indices)
+              ConstIndices.push_back(cast<Constant>(Idx));
+            NewGEP = ConstantExpr::getGetElementPtr(
+                NewElemTy, cast<Constant>(NewPtr), ConstIndices,
+                GEP->isInBounds());
+          }
+
+          WorkList.push_back({GEP, NewGEP});
+        }
+      }
+    }
+  }
+
+  /**
+   * Rewrites all uses of the narrowed globals across the whole module and
+   * deletes the original globals.
+   *
+   * This runs once, before any per-function processing, so the global
+   * replacements never depend on state that is reset between functions.
+   * Every function whose body was rewritten is added to ChangedFunctions.
+   */
+  void rewriteGlobalUses(ReplacementTracker &Tracker,
+                         SmallPtrSetImpl<Function *> &ChangedFunctions) {
+    for (const auto &Entry : Tracker.getGlobalReplacements()) {
+      if (Entry.first && Entry.second)
+        rewriteSlotUses(Entry.first, Entry.second, Tracker);
+    }
+
+    for (Instruction *I : Tracker.getToRemove())
+      ChangedFunctions.insert(I->getFunction());
+    removeDeadInstructions(Tracker);
+
+    for (const auto &Entry : Tracker.getGlobalReplacements()) {
+      if (!Entry.first)
+        continue;
+      GlobalVariable *OldGV = cast<GlobalVariable>(Entry.first);
+      OldGV->removeDeadConstantUsers();
+      if (!OldGV->use_empty()) {
+        errs() << "Warning: Narrowed global still has uses: "
+               << OldGV->getName() << "\n";
+        continue;
+      }
+      if (Entry.second)
+        Entry.second->takeName(OldGV);
+      OldGV->eraseFromParent();
+    }
+  }
+
+  /**
+   * Rewrites the accesses of every alloca narrowed in the current function.
+   *
+   * Work starts from the use lists of the replaced allocas and follows GEP
+   * chains, so the cost scales with the number of affected uses rather than
+   * with the size of the function. The original allocas are dead afterwards
+   * and are queued for removal.
+   */
+  void rewriteUses(ReplacementTracker &Tracker) {
+    for (const auto &Entry : Tracker.getAllocaReplacements()) {
+      if (!Entry.first || !Entry.second)
+        continue;
+      rewriteSlotUses(Entry.first, Entry.second, Tracker);
+      Tracker.markForRemoval(cast<AllocaInst>(Entry.first));
+    }
+  }
+
+  /**
+   * Decides which i64/double parameters and return value of F can be
+   * narrowed.
+   *
+   * F must be an internal function that is only called directly, so every
+   * incoming value is visible at a call site and every use of the result is
+   * in this module. A parameter is narrowed when the argument of every call
+   * fits; the return value when every returned value fits. Functions using
+   * musttail keep their signature, which musttail ties to the other side,
+   * and the return value is only narrowed when no call site is an invoke,
+   * since the result is widened right after the call.
+   *
+   * @return true if anything in the signature can be narrowed
+   */
+  bool planSignature(Function &F, RangeQuery &Query, SignaturePlan &Plan) {
+    if (F.isDeclaration() || F.use_empty() || !hasOnlyDirectCalls(F) ||
+        F.hasFnAttribute(Attribute::Naked) ||
+        F.getAttributes().hasAttrSomewhere(Attribute::Returned))
+      return false;
+
+    SmallVector<CallBase *, 8> Calls;
+    bool OnlyPlainCalls = true;
+    for (User *U : F.users()) {
+      auto *Call = cast<CallBase>(U);
+      if (isa<CallBrInst>(Call))
+        return false;
+      if (auto *CI = dyn_cast<CallInst>(Call)) {
+        if (CI->isMustTailCall())
+          return false;
+      } else {
+        OnlyPlainCalls = false;
+      }
+      Calls.push_back(Call);
+    }
+
+    SmallVector<ReturnInst *, 4> Returns;
+    for (BasicBlock &BB : F) {
+      for (Instruction &I : BB) {
+        if (auto *CI = dyn_cast<CallInst>(&I))
+          if (CI->isMustTailCall())
+            return false;
+      }
+      if (auto *Ret = dyn_cast<ReturnInst>(BB.getTerminator()))
+        Returns.push_back(Ret);
+    }
+
+    auto Fits = [&](Value *V, Instruction *CxtI) {
+      if (V->getType()->isIntegerTy(64))
+        return isSafeToCast(V, CxtI, Query);
+      return isSafeToCastFloat(V, Query);
+    };
+
+    bool Narrowed = false;
+    Plan.F = &F;
+    Plan.NarrowParam.assign(F.arg_size(), false);
+    for (Argument &Arg : F.args()) {
+      Type *Ty = Arg.getType();
+      if (!Ty->isIntegerTy(64) && !Ty->isDoubleTy())
+        continue;
+      bool AllFit = llvm::all_of(Calls, [&](CallBase *Call) {
+        return Fits(Call->getArgOperand(Arg.getArgNo()), Call);
+      });
+      Plan.NarrowParam[Arg.getArgNo()] = AllFit;
+      Narrowed |= AllFit;
+    }
+
+    Type *RetTy = F.getReturnType();
+    if (OnlyPlainCalls && (RetTy->isIntegerTy(64) || RetTy->isDoubleTy())) {
+      Plan.NarrowReturn = llvm::all_of(Returns, [&](ReturnInst *Ret) {
+        return Fits(Ret->getReturnValue(), Ret);
+      });
+      Narrowed |= Plan.NarrowReturn;
+    }
+
+    return Narrowed;
+  }
+
+  // Where code that reads the arguments goes: after the static allocas at
+  // the top of the entry block, which later passes expect to find grouped
+  static Instruction *getArgumentInsertionPoint(Function &F) {
+    BasicBlock::iterator IP = F.getEntryBlock().getFirstInsertionPt();
+    while (isa<AllocaInst>(IP) && cast<AllocaInst>(IP)->isStaticAlloca())
+      ++IP;
+    return &*IP;
+  }
+
+  // Drops the attributes that no longer apply to the narrowed positions
+  AttributeList narrowAttributes(AttributeList Attrs, const SignaturePlan &Plan,
+                                 FunctionType *NewFTy, LLVMContext &Ctx) {
+    for (unsigned i = 0; i < Plan.NarrowParam.size(); ++i) {
+      if (Plan.NarrowParam[i])
+        Attrs = Attrs.removeParamAttributes(
+            Ctx, i, AttributeFuncs::typeIncompatible(NewFTy->getParamType(i)));
+    }
+    if (Plan.NarrowReturn)
+      Attrs = Attrs.removeRetAttributes(
+          Ctx, AttributeFuncs::typeIncompatible(NewFTy->getReturnType()));
+    return Attrs;
+  }
+
+  /**
+   * Replaces an internal function by one with the narrowed signature.
+   *
+   * The body is moved into the new function. Narrowed parameters are
+   * sign-extended (or extended to double) right after the static allocas of
+   * the entry block, and returned values are truncated before each return,
+   * so the body itself is unchanged. Every call site is recreated with
+   * truncated arguments and, for a narrowed return, a widened result. The
+   * original function is deleted afterwards and the new one takes its name,
+   * so a function narrowed twice, or a specialized clone, is named once.
+   *
+   * @return the new function
+   */
+  Function *rewriteSignature(const SignaturePlan &Plan,
+                             FunctionAnalysisManager &FAM) {
+    Function *F = Plan.F;
+    LLVMContext &Ctx = F->getContext();
+    FunctionType *OldFTy = F->getFunctionType();
+
+    SmallVector<Type *, 8> Params;
+    for (unsigned i = 0; i < OldFTy->getNumParams(); ++i) {
+      Type *Ty = OldFTy->getParamType(i);
+      Params.push_back(Plan.NarrowParam[i] ? getOptimizedType(Ty, Ctx) : Ty);
+    }
+    Type *RetTy = OldFTy->getReturnType();
+    if (Plan.NarrowReturn)
+      RetTy = getOptimizedType(RetTy, Ctx);
+    FunctionType *NewFTy = FunctionType::get(RetTy, Params, /*isVarArg=*/false);
+
+    Function *NewF = Function::Create(NewFTy, F->getLinkage(),
+                                      F->getAddressSpace());
+    F->getParent()->getFunctionList().insert(F->getIterator(), NewF);
+    NewF->copyAttributesFrom(F);
+    NewF->setAttributes(narrowAttributes(F->getAttributes(), Plan, NewFTy, Ctx));
+    NewF->copyMetadata(F, 0);
+    F->clearMetadata();
+    NewF->getBasicBlockList().splice(NewF->begin(), F->getBasicBlockList());
+
+    IRBuilder<> Builder(getArgumentInsertionPoint(*NewF));
+    for (auto Args : zip(F->args(), NewF->args())) {
+      Argument &OldArg = std::get<0>(Args);
+      Argument &NewArg = std::get<1>(Args);
+      NewArg.takeName(&OldArg);
+      OldArg.replaceAllUsesWith(
+          createCastIfNeeded(Builder, &NewArg, OldArg.getType()));
+      if (NewArg.getType() != OldArg.getType())
+        ++NumParametersNarrowed;
+    }
+
+    if (Plan.NarrowReturn) {
+      ++NumReturnsNarrowed;
+      for (BasicBlock &BB : *NewF) {
+        auto *Ret = dyn_cast<ReturnInst>(BB.getTerminator());
+        if (!Ret)
+          continue;
+        Builder.SetInsertPoint(Ret);
+        Ret->setOperand(0,
+                        createCastIfNeeded(Builder, Ret->getReturnValue(), RetTy));
+      }
+    }
+
+    SmallVector<CallBase *, 8> Calls;
+    for (User *U : F->users())
+      Calls.push_back(cast<CallBase>(U));
+
+    for (CallBase *Call : Calls) {
+      Builder.SetInsertPoint(Call);
+      SmallVector<Value *, 8> Args;
+      for (unsigned i = 0; i < Call->arg_size(); ++i)
+        Args.push_back(createCastIfNeeded(Builder, Call->getArgOperand(i),
+                                          NewFTy->getParamType(i)));
+      SmallVector<OperandBundleDef, 1> Bundles;
+      Call->getOperandBundlesAsDefs(Bundles);
+
+      CallBase *NewCall;
+      if (auto *Invoke = dyn_cast<InvokeInst>(Call)) {
+        NewCall = InvokeInst::Create(NewFTy, NewF, Invoke->getNormalDest(),
+                                     Invoke->getUnwindDest(), Args, Bundles,
+                                     "", Call);
+      } else {
+        CallInst *NewCI = CallInst::Create(NewFTy, NewF, Args, Bundles, "", Call);
+        NewCI->setTailCallKind(cast<CallInst>(Call)->getTailCallKind());
+        NewCall = NewCI;
+      }
+      NewCall->setCallingConv(Call->getCallingConv());
+      NewCall->setAttributes(
+          narrowAttributes(Call->getAttributes(), Plan, NewFTy, Ctx));
+      NewCall->copyMetadata(*Call);
+      NewCall->takeName(Call);
+
+      // Only plain calls reach here with a narrowed return, so the widened
+      // result can go right after the call
+      Value *Result = NewCall;
+      if (Plan.NarrowReturn) {
+        NewCall->setMetadata(LLVMContext::MD_range, nullptr);
+        Result = createCastIfNeeded(Builder, NewCall, Call->getType());
+      }
+      Call->replaceAllUsesWith(Result);
+
+      Function *Caller = Call->getFunction();
+      Call->eraseFromParent();
+      FAM.invalidate(*Caller, getPreservedAnalysesForChange());
+    }
+
+    LLVM_DEBUG(dbgs() << "  Narrowed signature of " << F->getName() << " to "
+                      << *NewFTy << "\n");
+    FAM.clear(*F, F->getName());
+    NewF->takeName(F);
+    F->eraseFromParent();
+    return NewF;
+  }
+
+  // Whether a private copy of F would behave like F at every call site
+  bool canSpecialize(Function &F) {
+    if (F.isDeclaration() || !F.hasExactDefinition() || F.isVarArg() ||
+        F.isPresplitCoroutine() || F.hasFnAttribute(Attribute::Naked) ||
+        F.hasFnAttribute(Attribute::NoDuplicate) ||
+        F.getAttributes().hasAttrSomewhere(Attribute::Returned))
+      return false;
+    if (!llvm::any_of(F.args(), [](Argument &Arg) {
+          return Arg.getType()->isIntegerTy(64) || Arg.getType()->isDoubleTy();
+        }))
+      return false;
+    for (BasicBlock &BB : F)
+      for (Instruction &I : BB)
+        if (auto *CI = dyn_cast<CallInst>(&I))
+          if (CI->isMustTailCall())
+            return false;
+    return true;
+  }
+
+  // Bit i is set when the i-th argument of Call fits the narrowed type
+  uint64_t getNarrowableArguments(CallBase &Call, RangeQuery &Query) {
+    uint64_t Mask = 0;
+    unsigned NumArgs = std::min<unsigned>(Call.arg_size(), 64);
+    for (unsigned i = 0; i < NumArgs; ++i) {
+      Value *Actual = Call.getArgOperand(i);
+      bool Fits = false;
+      if (Actual->getType()->isIntegerTy(64))
+        Fits = isSafeToCast(Actual, &Call, Query);
+      else if (Actual->getType()->isDoubleTy())
+        Fits = isSafeToCastFloat(Actual, Query);
+      if (Fits)
+        Mask |= uint64_t(1) << i;
+    }
+    return Mask;
+  }
+
+  /**
+   * Estimates whether a clone of F whose masked parameters are narrowed
+   * would let the pass narrow something that it cannot narrow in F itself.
+   *
+   * F is examined twice without changing it: once as it is, and once
+   * assuming that the masked i64 parameters have the ranges the call sites
+   * pass and that the masked double parameters are extended floats, which
+   * is exactly what the clone will know. There is a gain when a slot only
+   * becomes narrowable under the assumptions, or when more divisions or
+   * arithmetic operations would be narrowed.
+   *
+   * @param Assumed The ranges of the masked i64 parameters
+   */
+  bool hasSpecializationGain(Function &F, uint64_t Mask,
+                             const ArgumentRangeMap &Assumed,
+                             RangeQuery &Query) {
+    SmallPtrSet<const Argument *, 4> AssumedFloats;
+    for (Argument &Arg : F.args())
+      if (Arg.getArgNo() < 64 && (Mask >> Arg.getArgNo() & 1) &&
+          Arg.getType()->isDoubleTy())
+        AssumedFloats.insert(&Arg);
+
+    // The assumptions are installed on the query of the run only while
+    // they are needed, so whatever the query keeps is shared with every
+    // other range query
+    const ArgumentRangeMap *OwnArgs = Query.AssumedArgs;
+    const SmallPtrSetImpl<const Argument *> *OwnFloats = Query.AssumedFloatArgs;
+    auto Assume = [&](bool Specialized) {
+      Query.AssumedArgs = Specialized ? &Assumed : OwnArgs;
+      Query.AssumedFloatArgs = Specialized ? &AssumedFloats : OwnFloats;
+    };
+
+    FunctionPlan Plan;
+    planFunction(F, Plan);
+    for (const SlotAccesses &Accesses : Plan.Accesses) {
+      StringRef Reason;
+      if (areStoredValuesNarrowable(Accesses, Query, Reason))
+        continue;
+      Assume(true);
+      bool Gain = areStoredValuesNarrowable(Accesses, Query, Reason);
+      Assume(false);
+      if (Gain)
+        return true;
+    }
+
+    auto CountNarrowed = [&](bool Specialized) {
+      unsigned Count = 0;
+      bool ChangedCFG = false;
+      Assume(Specialized);
+      narrowDivisions(Plan.Divisions, Query, ChangedCFG, &Count);
+      narrowOperations(Plan.Operations, Query, &Count);
+      Assume(false);
+      return Count;
+    };
+    if (Plan.Divisions.empty() && Plan.Operations.empty())
+      return false;
+    return CountNarrowed(true) > CountNarrowed(false);
+  }
+
+  /**
+   * Clones F for the given call sites and narrows the masked parameters of
+   * the clone. The clone is internal and only called from Calls, so its
+   * signature is narrowed by rewriteSignature like that of any other
+   * internal function; its body is processed with the other functions.
+   *
+   * @return the narrowed clone
+   */
+  Function *specializeFunction(Function &F, uint64_t Mask,
+                               ArrayRef<CallBase *> Calls,
+                               FunctionAnalysisManager &FAM) {
+    ValueToValueMapTy VMap;
+    Function *Clone = CloneFunction(&F, VMap);
+    Clone->setName(F.getName() + ".specialized");
+    Clone->setLinkage(GlobalValue::InternalLinkage);
+    Clone->setComdat(nullptr);
+
+    for (CallBase *Call : Calls)
+      Call->setCalledFunction(Clone);
+    NumCallSitesSpecialized += Calls.size();
+
+    SignaturePlan Plan;
+    Plan.F = Clone;
+    Plan.NarrowParam.assign(Clone->arg_size(), false);
+    for (unsigned i = 0; i < Plan.NarrowParam.size() && i < 64; ++i)
+      Plan.NarrowParam[i] = Mask >> i & 1;
+    return rewriteSignature(Plan, FAM);
+  }
+
+  /**
+   * Clones functions for call sites whose arguments are provably narrow,
+   * as long as the clones fit in the instruction budget.
+   *
+   * Call sites are grouped by callee and by the set of parameters they
+   * allow to be narrowed, and each group gets its own clone, but only when
+   * that clone can narrow a slot that the original cannot. Groups that
+   * cover every call of an internal function are left to signature
+   * narrowing, which needs no clone. Groups are visited in module order,
+   * so the budget is spent deterministically.
+   *
+   * @param CloneArgs Receives the ranges that the call sites pass to the
+   *        narrowed parameters of each clone
+   * @return true if any function was cloned
+   */
+  bool specializeCallSites(Module &M, RangeQuery &Query,
+                           ArgumentRangeMap &CloneArgs) {
+    DenseMap<Function *, bool> Specializable;
+    MapVector<std::pair<Function *, uint64_t>, SmallVector<CallBase *, 4>>
+        Groups;
+    for (Function &Caller : M) {
+      for (BasicBlock &BB : Caller) {
+        for (Instruction &I : BB) {
+          auto *Call = dyn_cast<CallBase>(&I);
+          Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+          if (!Callee || isa<CallBrInst>(Call) ||
+              Call->getFunctionType() != Callee->getFunctionType())
+            continue;
+          if (auto *CI = dyn_cast<CallInst>(Call))
+            if (CI->isMustTailCall())
+              continue;
+          auto Cached = Specializable.try_emplace(Callee, false);
+          if (Cached.second)
+            Cached.first->second = canSpecialize(*Callee);
+          if (!Cached.first->second)
+            continue;
+          if (uint64_t Mask = getNarrowableArguments(*Call, Query))
+            Groups[{Callee, Mask}].push_back(Call);
+        }
+      }
     }
-    
-    if (DestTy->isDoubleTy() && V->getType()->isFloatTy())
-      return Builder.CreateFPExt(V, DestTy);
-    if (DestTy->isFloatTy() && V->getType()->isDoubleTy())
-      return Builder.CreateFPTrunc(V, DestTy);
 
-    // Handle pointer types
-    if (DestTy->isPointerTy() && V->getType()->isPointerTy())
-      return Builder.CreateBitCast(V, DestTy);
+    unsigned Budget = SpecializationBudget;
+    bool Changed = false;
+    for (auto &Group : Groups) {
+      Function *F = Group.first.first;
+      uint64_t Mask = Group.first.second;
+      ArrayRef<CallBase *> Calls = Group.second;
+      if (hasOnlyDirectCalls(*F) && Calls.size() == F->getNumUses())
+        continue;
 
-    // Default case - bitcast if possible or return nullptr
-    if (V->getType()->canBitCastTo(DestTy))
-      return Builder.CreateBitCast(V, DestTy);
+      unsigned Size = F->getInstructionCount();
+      if (Size > Budget) {
+        LLVM_DEBUG(dbgs() << "  Not specializing " << F->getName()
+                          << " (over the code-size budget)\n");
+        continue;
+      }
 
-    return nullptr;
+      // The masked i64 parameters take the join of what the calls pass
+      ArgumentRangeMap Assumed;
+      for (Argument &Arg : F->args()) {
+        unsigned ArgNo = Arg.getArgNo();
+        if (ArgNo >= 64 || !(Mask >> ArgNo & 1) ||
+            !Arg.getType()->isIntegerTy(64))
+          continue;
+        ConstantRange Range = ConstantRange::getEmpty(64);
+        for (CallBase *Call : Calls)
+          Range = Range.unionWith(
+              getValueRange(Call->getArgOperand(ArgNo), Call, Query),
+              ConstantRange::Signed);
+        Assumed.try_emplace(&Arg, Range);
+      }
+      if (!hasSpecializationGain(*F, Mask, Assumed, Query))
+        continue;
+
+      LLVM_DEBUG(dbgs() << "  Specializing " << F->getName() << " for "
+                        << Calls.size() << " call sites\n");
+      Budget -= Size;
+      Function *Clone = specializeFunction(*F, Mask, Calls, Query.FAM);
+      for (auto &Entry : Assumed)
+        CloneArgs.try_emplace(Clone->getArg(Entry.first->getArgNo()),
+                              Entry.second.truncate(32));
+      ++NumFunctionsSpecialized;
+      Changed = true;
+    }
+    return Changed;
   }
 
-  bool optimizeAlloca(AllocaInst *Alloca, ScalarEvolution &SE, LLVMContext &Ctx, Function &F) {
-    Type *AllocaTy = Alloca->getAllocatedType();
-    Type *OptimizedTy = getOptimizedType(AllocaTy, Ctx);
-    
-    // Nothing to optimize
-    if (OptimizedTy == AllocaTy)
-      return false;
+  void removeDeadInstructions(ReplacementTracker &Tracker) {
+    // Replaced GEPs are only used by other replaced instructions, so erase
+    // in rounds until nothing more becomes dead
+    SmallVector<Instruction *, 64> Pending(Tracker.getToRemove().begin(),
+                                           Tracker.getToRemove().end());
+    // The asserting handles must be released before anything is erased
+    Tracker.clearToRemove();
 
-    // Create a new alloca with the smaller type
-    IRBuilder<> Builder(Alloca);
-    AllocaInst *NewAlloca = Builder.CreateAlloca(OptimizedTy, Alloca->getArraySize(),
-                                                Alloca->getName() + ".optimized");
-    NewAlloca->setAlignment(Alloca->getAlign());
-    
-    // Record this replacement
-    Tracker.addAllocaReplacement(Alloca, NewAlloca);
-    
-    unsigned OriginalSize = F.getParent()->getDataLayout().getTypeAllocSize(AllocaTy);
-    unsigned OptimizedSize = F.getParent()->getDataLayout().getTypeAllocSize(OptimizedTy);
-    NumTotalBytesReduced += (OriginalSize - OptimizedSize);
+    bool Erased = true;
+    while (Erased) {
+      Erased = false;
+      SmallVector<Instruction *, 64> StillUsed;
+      for (Instruction *I : Pending) {
+        if (!I->use_empty()) {
+          StillUsed.push_back(I);
+          continue;
+        }
+        I->eraseFromParent();
+        Erased = true;
+      }
+      Pending.swap(StillUsed);
+    }
 
-    if (AllocaTy->isDoubleTy() && OptimizedTy->isFloatTy()) {
-      ++NumFloatToFloatOptimized;
+    for (Instruction *I : Pending) {
+      errs() << "Warning: Attempting to remove instruction with uses: ";
+      I->print(errs());
+      errs() << "\n";
     }
-    
-    return true;
   }
 
-  void optimizeGlobal(GlobalVariable *GV, ScalarEvolution &SE, Module &M) {
-    Type *GVType = GV->getValueType();
-    Type *OptimizedTy = getOptimizedType(GVType, M.getContext());
-    
-    if (OptimizedTy == GVType)
-      return;
+  // Analyses that survive a change made by this pass. Only memory slots,
+  // their loads, stores and GEPs, arithmetic, and calls to functions whose
+  // signature was narrowed are replaced; apart from guarded divisions, no
+  // block or edge is ever added or removed.
+  static PreservedAnalyses getPreservedAnalysesForChange() {
+    PreservedAnalyses PA;
+    PA.preserveSet<CFGAnalyses>();
+    return PA;
+  }
 
-    // Create new global with the optimized type
-    GlobalVariable *NewGV = new GlobalVariable(
-        M, OptimizedTy, GV->isConstant(), GV->getLinkage(),
-        nullptr, GV->getName() + ".optimized", nullptr,
-        GV->getThreadLocalMode(), GV->getAddressSpace());
+  // i64 operations whose low 32 bits only depend on the low 32 bits of their
+  // operands, so that they can be computed in i32 instead
+  static bool isNarrowableOperation(const Instruction &I) {
+    if (!I.getType()->isIntegerTy(64))
+      return false;
+    switch (I.getOpcode()) {
+    case Instruction::Add:
+    case Instruction::Sub:
+    case Instruction::Mul:
+    case Instruction::Shl:
+    case Instruction::And:
+    case Instruction::Or:
+    case Instruction::Xor:
+      return true;
+    default:
+      return false;
+    }
+  }
 
-    // Handle initialization if present
-    if (GV->hasInitializer()) {
-        Constant *Init = GV->getInitializer();
-        
-        // Try to handle common initializers
-        if (isa<ConstantInt>(Init)) {
-            ConstantInt *CI = cast<ConstantInt>(Init);
-            if (OptimizedTy->isIntegerTy(32)) {
-                APInt TruncValue = CI->getValue().trunc(32);
-                NewGV->setInitializer(ConstantInt::get(OptimizedTy, TruncValue));
-            }
-        } else if (isa<ConstantFP>(Init) && OptimizedTy->isFloatTy()) {
-            ConstantFP *CF = cast<ConstantFP>(Init);
-            APFloat DoubleVal = CF->getValueAPF();
-            bool LosesInfo = false;
-            
-            const fltSemantics &FloatSemantics = APFloat::IEEEsingle();
-            APFloat NewFloat = APFloat(DoubleVal);
-            NewFloat.convert(FloatSemantics, APFloat::rmNearestTiesToEven, &LosesInfo);
-            
-            NewGV->setInitializer(ConstantFP::get(OptimizedTy, NewFloat));
-        } else {
-            // For complex initializers, just set to zero for now
-            NewGV->setInitializer(Constant::getNullValue(OptimizedTy));
-        }
+  static bool isDivision(const Instruction &I) {
+    if (!I.getType()->isIntegerTy(64))
+      return false;
+    switch (I.getOpcode()) {
+    case Instruction::SDiv:
+    case Instruction::UDiv:
+    case Instruction::SRem:
+    case Instruction::URem:
+      return true;
+    default:
+      return false;
     }
+  }
 
-    // Copy other attributes
-    NewGV->setAlignment(GV->getAlign());
-    NewGV->setDSOLocal(GV->isDSOLocal());
-    NewGV->setExternallyInitialized(GV->isExternallyInitialized());
-    
-    Tracker.addGlobalReplacement(GV, NewGV);
+  // Computes Div in i32 from the narrowed operands and extends the result
+  // back to i64
+  Value *createNarrowedDivision(IRBuilder<> &Builder, BinaryOperator *Div,
+                                Instruction *User,
+                                DenseMap<Value *, Value *> &Leaves) {
+    Value *LHS = getNarrowedLeaf(Div->getOperand(0), User, Leaves);
+    Value *RHS = getNarrowedLeaf(Div->getOperand(1), User, Leaves);
+    Value *Narrowed = Builder.CreateBinOp(Div->getOpcode(), LHS, RHS,
+                                          Div->getName() + ".downcasted");
+    if (auto *NarrowedDiv = dyn_cast<BinaryOperator>(Narrowed))
+      if (isa<PossiblyExactOperator>(Div))
+        NarrowedDiv->setIsExact(Div->isExact());
+    bool Signed = Div->getOpcode() == Instruction::SDiv ||
+                  Div->getOpcode() == Instruction::SRem;
+    return Builder.CreateIntCast(Narrowed, Div->getType(), Signed);
+  }
 
-    unsigned OriginalSize = M.getDataLayout().getTypeAllocSize(GVType);
-    unsigned OptimizedSize = M.getDataLayout().getTypeAllocSize(OptimizedTy);
-    NumTotalBytesReduced += (OriginalSize - OptimizedSize);
+  /**
+   * Narrows i64 sdiv/udiv/srem/urem to i32.
+   *
+   * Signed operations need both operands in the signed i32 range, and the
+   * INT32_MIN / -1 overflow must be excluded by one of the two ranges; the
+   * result is sign-extended back. Unsigned operations need both operands
+   * below 2^32, and the result is zero-extended back.
+   *
+   * With -type-downcaster-guarded-division, a division where only one
+   * operand is proven (and the divisor is not a constant, which the backend
+   * already turns into a multiplication) is split into an i32 fast path
+   * and the original i64 division, selected by a run-time check of the
+   * unproven operand. Every decision is made before the first block is
+   * split, while the analyses still describe the function.
+   *
+   * @param ChangedCFG Set when a guarded division added blocks
+   * @param DryRunCount If given, nothing is changed and the number of
+   *        divisions that need no run-time check is added to it instead
+   * @return true if any division was changed
+   */
+  bool narrowDivisions(ArrayRef<BinaryOperator *> Divisions, RangeQuery &Query,
+                       bool &ChangedCFG, unsigned *DryRunCount = nullptr) {
+    // Division, run-time check needed for the LHS, the RHS, and -1 divisors
+    struct Decision {
+      BinaryOperator *Div;
+      bool CheckLHS, CheckRHS, CheckMinusOne;
+      ProofLog Log;
+    };
+    SmallVector<Decision, 4> Decisions;
 
-    if (GVType->isDoubleTy() && OptimizedTy->isFloatTy()) {
-      ++NumFloatToFloatOptimized;
+    APInt Int32Min = APInt::getSignedMinValue(32).sext(64);
+    APInt MinusOne = APInt::getAllOnes(64);
+    for (BinaryOperator *Div : Divisions) {
+      bool Signed = Div->getOpcode() == Instruction::SDiv ||
+                    Div->getOpcode() == Instruction::SRem;
+      Value *RHS = Div->getOperand(1);
+      RangeSource LHSSource, RHSSource;
+      ConstantRange LHSRange =
+          getValueRange(Div->getOperand(0), Div, Query, &LHSSource);
+      ConstantRange RHSRange = getValueRange(RHS, Div, Query, &RHSSource);
+      auto Fits = [&](const ConstantRange &Range) {
+        return Signed ? fitsInNarrowedInt(Range)
+                      : Range.getUnsignedMax().isIntN(32);
+      };
+      bool LHSFits = Fits(LHSRange);
+      bool RHSFits = Fits(RHSRange);
+      bool MayOverflow = Signed && LHSRange.contains(Int32Min) &&
+                         RHSRange.contains(MinusOne);
+
+      if (!(LHSFits && RHSFits && !MayOverflow) &&
+          (!GuardedDivision || (!LHSFits && !RHSFits) || isa<Constant>(RHS)))
+        continue;
+      Decisions.push_back({Div, !LHSFits, !RHSFits, MayOverflow, ProofLog()});
+      if (LHSFits)
+        Decisions.back().Log.Sources.push_back(LHSSource);
+      if (RHSFits)
+        Decisions.back().Log.Sources.push_back(RHSSource);
     }
 
-    // Make the original global internal linkage if external - helps LLVM clean it up
-    if (!GV->hasLocalLinkage()) {
-      GV->setLinkage(GlobalValue::InternalLinkage);
+    if (DryRunCount) {
+      for (const Decision &D : Decisions)
+        *DryRunCount += !D.CheckLHS && !D.CheckRHS && !D.CheckMinusOne;
+      return false;
     }
-  }
 
-  void rewriteUses(Function &F) {
-    std::vector<Instruction *> WorkList;
-    
-    // Setup worklist to start with all instructions
-    for (auto &BB : F) {
-      for (auto &I : BB) {
-        WorkList.push_back(&I);
+    DenseMap<Value *, Value *> Leaves;
+    for (const Decision &D : Decisions) {
+      BinaryOperator *Div = D.Div;
+      bool Signed = Div->getOpcode() == Instruction::SDiv ||
+                    Div->getOpcode() == Instruction::SRem;
+      IRBuilder<> Builder(Div);
+      recordProofs(D.Log);
+
+      if (!D.CheckLHS && !D.CheckRHS && !D.CheckMinusOne) {
+        Value *Narrowed = createNarrowedDivision(Builder, Div, Div, Leaves);
+        Div->replaceAllUsesWith(Narrowed);
+        Div->eraseFromParent();
+        ++NumDivisionsNarrowed;
+        continue;
       }
+
+      auto FitsAtRunTime = [&](Value *V) {
+        if (!Signed)
+          return Builder.CreateICmpULT(
+              V, ConstantInt::get(V->getType(), APInt::getOneBitSet(64, 32)));
+        Value *Low = Builder.CreateTrunc(V, Builder.getInt32Ty());
+        return Builder.CreateICmpEQ(Builder.CreateSExt(Low, V->getType()), V);
+      };
+      SmallVector<Value *, 3> Checks;
+      if (D.CheckLHS)
+        Checks.push_back(FitsAtRunTime(Div->getOperand(0)));
+      if (D.CheckRHS)
+        Checks.push_back(FitsAtRunTime(Div->getOperand(1)));
+      if (D.CheckMinusOne)
+        Checks.push_back(Builder.CreateICmpNE(
+            Div->getOperand(1), ConstantInt::get(Div->getType(), MinusOne)));
+      Value *Cond = Builder.CreateAnd(Checks);
+
+      Instruction *ThenTerm, *ElseTerm;
+      SplitBlockAndInsertIfThenElse(Cond, Div, &ThenTerm, &ElseTerm);
+      BasicBlock *Tail = Div->getParent();
+
+      Builder.SetInsertPoint(ThenTerm);
+      Builder.SetCurrentDebugLocation(Div->getDebugLoc());
+      Value *Fast = createNarrowedDivision(Builder, Div, ThenTerm, Leaves);
+      Div->moveBefore(ElseTerm);
+
+      PHINode *Merged = PHINode::Create(Div->getType(), 2, "", &Tail->front());
+      Merged->setDebugLoc(Div->getDebugLoc());
+      Div->replaceAllUsesWith(Merged);
+      Merged->takeName(Div);
+      Merged->addIncoming(Fast, ThenTerm->getParent());
+      Merged->addIncoming(Div, ElseTerm->getParent());
+      ChangedCFG = true;
+      ++NumDivisionsGuarded;
     }
-    
-    while (!WorkList.empty()) {
-      Instruction *I = WorkList.back();
-      WorkList.pop_back();
-      
-      if (Tracker.isProcessed(I))
+    return !Decisions.empty();
+  }
+
+  // Values extended from at most 32 bits; their narrowed form is the source
+  static bool isExtendedFromNarrow(Value *V) {
+    auto *Ext = dyn_cast<CastInst>(V);
+    return Ext && (isa<SExtInst>(Ext) || isa<ZExtInst>(Ext)) &&
+           Ext->getSrcTy()->getIntegerBitWidth() <= 32;
+  }
+
+  // Whether the value of a chain member is needed in i64 outside the chain.
+  // Truncations to at most 32 bits only read the low bits, which the
+  // narrowed chain computes exactly.
+  static bool isNeededWide(Instruction *I,
+                           const SmallPtrSetImpl<Instruction *> &Members) {
+    for (User *U : I->users()) {
+      auto *UserI = cast<Instruction>(U);
+      if (Members.count(UserI))
         continue;
-        
-      Tracker.markProcessed(I);
-      
-      // Skip instructions marked for removal
-      if (Tracker.getToRemove().count(I))
+      if (isa<TruncInst>(UserI) && UserI->getType()->getIntegerBitWidth() <= 32)
         continue;
-      
-      // If this is a load or store accessing a modified allocation/global
-      if (LoadInst *LI = dyn_cast<LoadInst>(I)) {
-        Value *Ptr = LI->getPointerOperand();
-        if (Tracker.hasReplacement(Ptr)) {
-          IRBuilder<> Builder(LI);
-          Value *NewPtr = Tracker.getReplacement(Ptr);
-          
-          Type *OriginalType = LI->getType();
-          Type *NewPtrElemTy = NewPtr->getType()->getPointerElementType();
-          
-          // Create load from the new memory location
-          LoadInst *NewLoad = Builder.CreateLoad(NewPtrElemTy, NewPtr, LI->getName() + ".downcasted");
-          NewLoad->setAlignment(LI->getAlign());
-          NewLoad->setVolatile(LI->isVolatile());
-          NewLoad->setOrdering(LI->getOrdering());
-          
-          // Cast back to the original type if needed
-          Value *Result = createCastIfNeeded(Builder, NewLoad, OriginalType);
-          
-          if (Result) {
-            LI->replaceAllUsesWith(Result);
-            Tracker.markForRemoval(LI);
+      return true;
+    }
+    return false;
+  }
+
+  /**
+   * Returns the i32 form of a value that enters a narrowed chain.
+   *
+   * Constants are truncated, values extended from at most 32 bits are
+   * replaced by their source, and anything else is truncated once, right
+   * after its definition, so the truncation serves every user in the chain.
+   */
+  Value *getNarrowedLeaf(Value *V, Instruction *User,
+                         DenseMap<Value *, Value *> &Leaves) {
+    Type *Int32Ty = Type::getInt32Ty(V->getContext());
+    if (auto *C = dyn_cast<Constant>(V))
+      return ConstantExpr::getTrunc(C, Int32Ty);
+
+    auto It = Leaves.find(V);
+    if (It != Leaves.end())
+      return It->second;
+
+    Value *Narrowed;
+    if (isExtendedFromNarrow(V)) {
+      auto *Ext = cast<CastInst>(V);
+      IRBuilder<> Builder(Ext);
+      Narrowed = Builder.CreateIntCast(Ext->getOperand(0), Int32Ty,
+                                       isa<SExtInst>(Ext));
+    } else if (auto *Arg = dyn_cast<Argument>(V)) {
+      IRBuilder<> Builder(getArgumentInsertionPoint(*Arg->getParent()));
+      Narrowed = Builder.CreateTrunc(V, Int32Ty);
+    } else {
+      auto *Def = cast<Instruction>(V);
+      if (Def->isTerminator()) {
+        // The result of an invoke is only available on its normal edge;
+        // truncate next to the user instead and do not share it
+        IRBuilder<> Builder(User);
+        return Builder.CreateTrunc(V, Int32Ty);
+      }
+      IRBuilder<> Builder(isa<PHINode>(Def)
+                              ? &*Def->getParent()->getFirstInsertionPt()
+                              : Def->getNextNode());
+      Narrowed = Builder.CreateTrunc(V, Int32Ty);
+    }
+    Leaves[V] = Narrowed;
+    return Narrowed;
+  }
+
+  // Creates the i32 form of a chain member and, first, of its operands
+  Value *getNarrowedMember(Instruction *I,
+                           const SmallPtrSetImpl<Instruction *> &Chain,
+                           DenseMap<Value *, Value *> &Narrowed,
+                           DenseMap<Value *, Value *> &Leaves) {
+    auto It = Narrowed.find(I);
+    if (It != Narrowed.end())
+      return It->second;
+
+    Value *Ops[2];
+    for (unsigned i = 0; i < 2; ++i) {
+      auto *OpI = dyn_cast<Instruction>(I->getOperand(i));
+      Ops[i] = OpI && Chain.count(OpI)
+                   ? getNarrowedMember(OpI, Chain, Narrowed, Leaves)
+                   : getNarrowedLeaf(I->getOperand(i), I, Leaves);
+    }
+
+    // Wrap flags do not carry over: the i32 form may wrap where the i64
+    // one did not, and only its low bits are relied upon
+    IRBuilder<> Builder(I);
+    Value *Result =
+        Builder.CreateBinOp(cast<BinaryOperator>(I)->getOpcode(), Ops[0],
+                            Ops[1], I->getName() + ".downcasted");
+    Narrowed[I] = Result;
+    return Result;
+  }
+
+  /**
+   * Narrows chains of i64 arithmetic to i32.
+   *
+   * add, sub, mul, shl, and, or and xor compute the low 32 bits of their
+   * result from the low 32 bits of their operands alone, so a connected
+   * chain of them can run in i32 with truncations only where values enter.
+   * Where a value leaves the chain it is either truncated anyway, compared
+   * against another value that fits in i32, or sign-extended back, which
+   * requires its whole signed range to fit, unless DemandedBits shows that
+   * no user observes the upper 32 bits anyway. Members for which neither
+   * holds but whose value is needed wide are dropped from the chain until
+   * every remaining exit is covered. Shifts stay wide unless their amount
+   * is below 32.
+   *
+   * A chain is only rewritten when it narrows more instructions than the
+   * casts it has to insert. That count is first made from the shape of the
+   * chain alone, as if every member stayed and every compare were narrowed,
+   * and chains that do not pay off even then are given up before any range
+   * is computed.
+   *
+   * @param DryRunCount If given, nothing is changed and the number of
+   *        instructions that would be narrowed is added to it instead.
+   *        Parameters with an assumed range then enter chains for free, as
+   *        they will in a specialized clone.
+   * @return true if any chain was narrowed
+   */
+  bool narrowOperations(ArrayRef<Instruction *> Operations, RangeQuery &Query,
+                        unsigned *DryRunCount = nullptr) {
+    SmallPtrSet<Instruction *, 32> Members(Operations.begin(), Operations.end());
+
+    // Splits the members into connected chains
+    auto SplitChains = [&]() {
+      EquivalenceClasses<Instruction *> Classes;
+      for (Instruction *I : Operations) {
+        if (!Members.count(I))
+          continue;
+        Classes.insert(I);
+        for (Value *Op : I->operands())
+          if (auto *OpI = dyn_cast<Instruction>(Op))
+            if (Members.count(OpI))
+              Classes.unionSets(I, OpI);
+      }
+      MapVector<Instruction *, SmallVector<Instruction *, 8>> Chains;
+      for (Instruction *I : Operations)
+        if (Members.count(I))
+          Chains[Classes.getLeaderValue(I)].push_back(I);
+      return Chains;
+    };
+
+    // What narrowing a chain takes: the exits that compare two values
+    // fitting in i32 are narrowed as well, leaves are truncated unless they
+    // are constants or extended from narrow values, and every other wide
+    // exit needs a sign extension
+    struct ChainShape {
+      SmallSetVector<ICmpInst *, 4> Compares;
+      SmallSetVector<Value *, 8> PaidLeaves;
+      SmallSetVector<Instruction *, 8> ExtendedLeaves;
+      unsigned NumExtensions = 0;
+    };
+    auto IsProfitable = [&](ArrayRef<Instruction *> Chain,
+                            const SmallPtrSetImpl<Instruction *> &InChain,
+                            function_ref<bool(ICmpInst *)> CompareFits,
+                            ChainShape &Shape) {
+      for (Instruction *I : Chain) {
+        for (Value *Op : I->operands()) {
+          auto *OpI = dyn_cast<Instruction>(Op);
+          if (OpI && InChain.count(OpI))
+            continue;
+          auto *Arg = dyn_cast<Argument>(Op);
+          if (DryRunCount && Arg && Query.AssumedArgs &&
+              Query.AssumedArgs->count(Arg))
+            continue;
+          if (isExtendedFromNarrow(Op))
+            Shape.ExtendedLeaves.insert(OpI);
+          else if (!isa<Constant>(Op))
+            Shape.PaidLeaves.insert(Op);
+        }
+        bool NeedsExtension = false;
+        for (User *U : I->users()) {
+          auto *UserI = cast<Instruction>(U);
+          if (InChain.count(UserI) ||
+              (isa<TruncInst>(UserI) &&
+               UserI->getType()->getIntegerBitWidth() <= 32))
+            continue;
+          auto *Cmp = dyn_cast<ICmpInst>(UserI);
+          if (Cmp && CompareFits(Cmp)) {
+            Shape.Compares.insert(Cmp);
+            continue;
           }
+          NeedsExtension = true;
         }
+        Shape.NumExtensions += NeedsExtension;
       }
-      else if (StoreInst *SI = dyn_cast<StoreInst>(I)) {
-        Value *Ptr = SI->getPointerOperand();
-        if (Tracker.hasReplacement(Ptr)) {
-          IRBuilder<> Builder(SI);
-          Value *NewPtr = Tracker.getReplacement(Ptr);
-          Value *ValToStore = SI->getValueOperand();
-          Type *NewPtrElemTy = NewPtr->getType()->getPointerElementType();
-          
-          // Cast the value to the new type if needed
-          Value *NewValToStore = createCastIfNeeded(Builder, ValToStore, NewPtrElemTy);
-          
-          if (NewValToStore) {
-            // Create store to the new memory location
-            StoreInst *NewStore = Builder.CreateStore(NewValToStore, NewPtr);
-            NewStore->setAlignment(SI->getAlign());
-            NewStore->setVolatile(SI->isVolatile());
-            NewStore->setOrdering(SI->getOrdering());
-            
-            Tracker.markForRemoval(SI);
-          }
+      return Shape.PaidLeaves.size() + Shape.NumExtensions <
+             Chain.size() + Shape.Compares.size();
+    };
+
+    for (auto &Entry : SplitChains()) {
+      ArrayRef<Instruction *> Chain = Entry.second;
+      SmallPtrSet<Instruction *, 8> InChain(Chain.begin(), Chain.end());
+      ChainShape Shape;
+      if (IsProfitable(Chain, InChain, [](ICmpInst *) { return true; }, Shape))
+        continue;
+      LLVM_DEBUG(dbgs() << "  Kept chain of " << Chain.size()
+                        << " operations wide (not profitable)\n");
+      for (Instruction *I : Chain)
+        Members.erase(I);
+    }
+
+    for (Instruction *I : Operations) {
+      if (!Members.count(I) || I->getOpcode() != Instruction::Shl)
+        continue;
+      ConstantRange Amount = getValueRange(I->getOperand(1), I, Query);
+      if (!Amount.getUnsignedMax().ult(32))
+        Members.erase(I);
+    }
+
+    // The layer that proved each value that fits at a use, or None. Ranges
+    // depend on the use, so the use is part of the key.
+    DenseMap<std::pair<Value *, Instruction *>, Optional<RangeSource>>
+        FitsCache;
+    auto Fits = [&](Value *V, Instruction *CxtI) {
+      auto Cached = FitsCache.try_emplace({V, CxtI}, None);
+      if (Cached.second) {
+        RangeSource Source;
+        if (fitsInNarrowedInt(getValueRange(V, CxtI, Query, &Source)))
+          Cached.first->second = Source;
+        else if (proveFitsBySMT(V, CxtI, Query))
+          Cached.first->second = RangeSource::SMT;
+      }
+      return Cached.first->second.hasValue();
+    };
+
+    SmallPtrSet<Instruction *, 8> LowHalfOnly;
+    bool Dropped = true;
+    while (Dropped) {
+      Dropped = false;
+      for (Instruction *I : Operations) {
+        if (!Members.count(I) || !isNeededWide(I, Members) || Fits(I, I))
+          continue;
+        if (isOnlyLowHalfDemanded(I, Query)) {
+          LowHalfOnly.insert(I);
+          continue;
         }
+        Members.erase(I);
+        Dropped = true;
+      }
+    }
+    if (Members.empty())
+      return false;
+
+    bool Changed = false;
+    for (auto &Entry : SplitChains()) {
+      ArrayRef<Instruction *> Chain = Entry.second;
+      SmallPtrSet<Instruction *, 8> InChain(Chain.begin(), Chain.end());
+
+      auto FitsNarrowed = [&](Value *V, Instruction *CxtI) {
+        auto *I = dyn_cast<Instruction>(V);
+        return (I && InChain.count(I)) || Fits(V, CxtI);
+      };
+      ChainShape Shape;
+      if (!IsProfitable(Chain, InChain,
+                        [&](ICmpInst *Cmp) {
+                          return FitsNarrowed(Cmp->getOperand(0), Cmp) &&
+                                 FitsNarrowed(Cmp->getOperand(1), Cmp);
+                        },
+                        Shape)) {
+        LLVM_DEBUG(dbgs() << "  Kept chain of " << Chain.size()
+                          << " operations wide (not profitable)\n");
+        continue;
+      }
+      ArrayRef<ICmpInst *> Compares = Shape.Compares.getArrayRef();
+      unsigned NumNarrowed = Chain.size() + Compares.size();
+      if (DryRunCount) {
+        *DryRunCount += NumNarrowed;
+        continue;
+      }
+
+      DenseMap<Value *, Value *> Narrowed, Leaves;
+      for (Instruction *I : Chain)
+        getNarrowedMember(I, InChain, Narrowed, Leaves);
+
+      auto GetNarrowed = [&](Value *V, Instruction *User) {
+        auto *I = dyn_cast<Instruction>(V);
+        if (I && InChain.count(I))
+          return Narrowed[I];
+        return getNarrowedLeaf(V, User, Leaves);
+      };
+
+      for (ICmpInst *Cmp : Compares) {
+        IRBuilder<> Builder(Cmp);
+        Value *NewCmp = Builder.CreateICmp(
+            Cmp->getPredicate(), GetNarrowed(Cmp->getOperand(0), Cmp),
+            GetNarrowed(Cmp->getOperand(1), Cmp));
+        NewCmp->takeName(Cmp);
+        Cmp->replaceAllUsesWith(NewCmp);
+        Cmp->eraseFromParent();
       }
-      // Handle GEP instructions for struct field access
-      else if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(I)) {
-        Value *Ptr = GEP->getPointerOperand();
-        if (Tracker.hasReplacement(Ptr)) {
-          IRBuilder<> Builder(GEP);
-          Value *NewPtr = Tracker.getReplacement(Ptr);
-          
-          // Recreate the GEP with the new pointer base
-          SmallVector<Value *, 4> Indices;
-          for (auto I = GEP->idx_begin(), E = GEP->idx_end(); I != E; ++I) {
-            Indices.push_back(*I);
+
+      for (Instruction *I : Chain) {
+        Value *NewI = Narrowed[I];
+        Value *Extended = nullptr;
+        SmallSetVector<Instruction *, 4> Users;
+        for (User *U : I->users())
+          Users.insert(cast<Instruction>(U));
+        for (Instruction *UserI : Users) {
+          if (InChain.count(UserI))
+            continue;
+          if (isa<TruncInst>(UserI) &&
+              UserI->getType()->getIntegerBitWidth() <= 32) {
+            IRBuilder<> Builder(UserI);
+            // A user that truncates to i32 is the narrowed member itself
+            Value *Low = Builder.CreateTrunc(NewI, UserI->getType());
+            if (Low != NewI)
+              Low->takeName(UserI);
+            UserI->replaceAllUsesWith(Low);
+            UserI->eraseFromParent();
+            continue;
           }
-          
-          Value *NewGEP = Builder.CreateGEP(
-              NewPtr->getType()->getPointerElementType(),
-              NewPtr, Indices, GEP->getName() + ".optimized");
-          
-          Tracker.addReplacement(GEP, NewGEP);
+          if (!Extended) {
+            IRBuilder<> Builder(I);
+            Extended = Builder.CreateSExt(NewI, I->getType());
+          }
+          UserI->replaceUsesOfWith(I, Extended);
+        }
+      }
+
+      // Exits that were sign-extended back were proven by a range or by
+      // DemandedBits
+      ProofLog Log;
+      for (Instruction *I : Chain) {
+        if (LowHalfOnly.count(I)) {
+          ++NumDemandedBitsProofs;
+          continue;
         }
+        auto It = FitsCache.find({I, I});
+        if (It != FitsCache.end() && It->second)
+          Log.Sources.push_back(*It->second);
       }
+      recordProofs(Log);
+
+      // Only other members still use the wide instructions
+      for (Instruction *I : Chain)
+        I->dropAllReferences();
+      for (Instruction *I : Chain)
+        I->eraseFromParent();
+      for (Instruction *Ext : Shape.ExtendedLeaves)
+        if (Ext->use_empty())
+          Ext->eraseFromParent();
+      // Entries may name erased compares and members
+      FitsCache.clear();
+
+      NumOperationsNarrowed += NumNarrowed;
+      LLVM_DEBUG(dbgs() << "  Narrowed chain of " << Chain.size()
+                        << " operations and " << Compares.size()
+                        << " compares\n");
+      Changed = true;
     }
+    return Changed;
   }
 
-  void removeDeadInstructions(Function &F) {
-    for (Instruction *I : Tracker.getToRemove()) {
-      if (!I->use_empty()) {
-        errs() << "Warning: Attempting to remove instruction with uses: ";
-        I->print(errs());
-        errs() << "\n";
-        continue;
+  /**
+   * Read-only first stage of processing a function.
+   *
+   * Finds the eligible allocas and collects their loads and stores. Nothing
+   * is created and no analysis is requested.
+   */
+  void planFunction(Function &F, FunctionPlan &Plan) {
+    Plan.F = &F;
+    for (auto &BB : F) {
+      for (auto &I : BB) {
+        if (isNarrowableOperation(I)) {
+          Plan.Operations.push_back(&I);
+          continue;
+        }
+        if (isDivision(I)) {
+          Plan.Divisions.push_back(cast<BinaryOperator>(&I));
+          continue;
+        }
+
+        AllocaInst *Alloca = dyn_cast<AllocaInst>(&I);
+        if (!Alloca || !isEligibleForOptimization(Alloca->getAllocatedType()))
+          continue;
+
+        SlotAccesses Accesses;
+        StringRef Reason;
+        if (!collectSlotAccesses(Alloca, Accesses, Reason)) {
+          Plan.Rejected.push_back({Alloca, Reason});
+          continue;
+        }
+        Plan.Candidates.push_back(Alloca);
+        Plan.Accesses.push_back(std::move(Accesses));
       }
-      I->eraseFromParent();
     }
   }
 
-  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
-    // Skip functions with no body
-    if (F.isDeclaration())
-      return PreservedAnalyses::all();
+  /**
+   * Serial second stage: proves the stored ranges of the planned allocas,
+   * narrows the ones that fit and rewrites their uses, then narrows the
+   * planned arithmetic.
+   */
+  PreservedAnalyses applyPlan(FunctionPlan &Plan, RangeQuery &Query,
+                              ReplacementTracker &Tracker) {
+    Function &F = *Plan.F;
+
+    for (auto &Entry : Plan.Rejected) {
+      ++NumAllocasRejected;
+      LLVM_DEBUG(dbgs() << "  Kept alloca wide (" << Entry.second
+                        << "): " << *Entry.first << "\n");
+    }
 
-    // Get necessary analysis results
-    ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
-    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+    if (Plan.Candidates.empty() && Plan.Operations.empty() &&
+        Plan.Divisions.empty())
+      return PreservedAnalyses::all();
     
     LLVM_DEBUG(dbgs() << "TypeDowncaster: Processing function " << F.getName() << "\n");
     
     bool MadeChanges = false;
-    Module *M = F.getParent();
-    LLVMContext &Ctx = M->getContext();
+    LLVMContext &Ctx = F.getContext();
     
     // Clear any previous data in the tracker
     Tracker.clear();
     
-    // First step: Analyze and optimize stack allocations
-    for (auto &BB : F) {
-      for (auto &I : BB) {
-        if (AllocaInst *Alloca = dyn_cast<AllocaInst>(&I)) {
-          if (isEligibleForOptimization(Alloca->getAllocatedType())) {
-            if (optimizeAlloca(Alloca, SE, Ctx, F)) {
-              MadeChanges = true;
-              ++NumAllocasOptimized;
-              LLVM_DEBUG(dbgs() << "  Optimized alloca: " << *Alloca << "\n");
-            }
-          }
+    // First step: Analyze and optimize stack allocations. Analyses are only
+    // requested once a stored value actually needs a range.
+    auto NarrowSlot = [&](unsigned Idx, const ProofLog &Log) {
+      AllocaInst *Alloca = Plan.Candidates[Idx];
+      if (!optimizeAlloca(Alloca, Ctx, F, Tracker))
+        return false;
+      if (Log.ByErrorBound)
+        Query.RoundedObjects.push_back(
+            Tracker.getAllocaReplacements().back().second);
+      MadeChanges = true;
+      ++NumAllocasOptimized;
+      recordProofs(Log);
+      LLVM_DEBUG(dbgs() << "  Optimized alloca: " << *Alloca << "\n");
+      return Log.ByErrorBound;
+    };
+
+    // A slot whose rounded value is stored into another slot can only be
+    // narrowed once that slot is, so the rejected slots are tried again as
+    // long as slots are narrowed by the error bound
+    SmallVector<SlotAccesses, 4> RoundingSlots;
+    SmallVector<std::pair<unsigned, StringRef>, 8> Rejected;
+    for (unsigned i = 0; i < Plan.Candidates.size(); ++i)
+      Rejected.push_back({i, StringRef()});
+    for (bool Retry = true; Retry;) {
+      Retry = false;
+      SmallVector<std::pair<unsigned, StringRef>, 8> Remaining;
+      std::swap(Remaining, Rejected);
+      for (auto &Entry : Remaining) {
+        StringRef Reason;
+        ProofLog Log;
+        if (!areStoredValuesNarrowable(Plan.Accesses[Entry.first], Query,
+                                       Reason, &Log, &RoundingSlots)) {
+          Rejected.push_back({Entry.first, Reason});
+          continue;
         }
+        Retry |= NarrowSlot(Entry.first, Log);
       }
     }
+
+    // Slots that depend on each other, such as a rounded slot and a copy
+    // of it, are narrowed together: each is checked with the others counted
+    // as narrowed, and the first one that still fails is dropped until the
+    // rest pass
+    SmallVector<std::pair<unsigned, StringRef>, 8> Group;
+    if (FPTolerance > 0)
+      std::swap(Group, Rejected);
+    while (Group.size() > 1) {
+      SmallVector<ProofLog, 4> Logs(Group.size());
+      auto Failed = llvm::find_if(Group, [&](auto &Entry) {
+        SmallVector<SlotAccesses, 4> Trial(RoundingSlots);
+        for (auto &Other : Group)
+          if (&Other != &Entry)
+            Trial.push_back(Plan.Accesses[Other.first]);
+        return !areStoredValuesNarrowable(Plan.Accesses[Entry.first], Query,
+                                          Entry.second,
+                                          &Logs[&Entry - Group.begin()],
+                                          &Trial);
+      });
+      if (Failed == Group.end()) {
+        for (unsigned i = 0; i < Group.size(); ++i)
+          NarrowSlot(Group[i].first, Logs[i]);
+        Group.clear();
+        break;
+      }
+      Rejected.push_back(*Failed);
+      Group.erase(Failed);
+    }
+    Rejected.append(Group.begin(), Group.end());
+
+    for (auto &Entry : Rejected) {
+      ++NumAllocasRejected;
+      LLVM_DEBUG(dbgs() << "  Kept alloca wide (" << Entry.second
+                        << "): " << *Plan.Candidates[Entry.first] << "\n");
+    }
     
     // Second step: Apply the transformations to uses
     if (MadeChanges) {
-      rewriteUses(F);
-      removeDeadInstructions(F);
+      rewriteUses(Tracker);
+      removeDeadInstructions(Tracker);
+    }
+
+    // The ranges computed so far are dropped whenever a later step needs
+    // ranges of the changed function
+    bool ChangedCFG = false;
+    bool Stale = MadeChanges;
+    auto RefreshAnalyses = [&]() {
+      if (!Stale)
+        return;
+      Query.FAM.invalidate(F, ChangedCFG ? PreservedAnalyses::none()
+                                         : getPreservedAnalysesForChange());
+      Stale = false;
+    };
+
+    // Third step: Narrow divisions and remainders. Their results become
+    // extended i32 values, which the arithmetic chains take for free.
+    if (!Plan.Divisions.empty()) {
+      RefreshAnalyses();
+      if (narrowDivisions(Plan.Divisions, Query, ChangedCFG))
+        MadeChanges = Stale = true;
     }
 
-    // If we changed anything, mark all analyses as invalidated
+    // Fourth step: Narrow SSA arithmetic. Loads of narrowed slots are now
+    // sign-extended i32 values, which makes them free leaves as well.
+    if (!Plan.Operations.empty()) {
+      RefreshAnalyses();
+      MadeChanges |= narrowOperations(Plan.Operations, Query);
+    }
+
+    // If we changed anything, invalidate everything but the CFG analyses,
+    // which only guarded divisions change
     if (MadeChanges) {
       LLVM_DEBUG(dbgs() << "  Made changes to function " << F.getName() << "\n");
-      return PreservedAnalyses::none();
+      if (ChangedCFG)
+        return PreservedAnalyses::none();
+      return getPreservedAnalysesForChange();
     }
     
     return PreservedAnalyses::all();
   }
 
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+    // Skip functions with no body
+    if (F.isDeclaration())
+      return PreservedAnalyses::all();
+
+    // Cheap pre-scan: most functions have no eligible allocas left, and
+    // those must not pay for any analysis
+    FunctionPlan Plan;
+    planFunction(F, Plan);
+
+    // The tracker is local to this run, like all other replacement state,
+    // so the pass stays reentrant. A run only sees one function, so there
+    // is no storage to reuse; the module path shares one tracker instead.
+    RangeQuery Query(AM);
+    ReplacementTracker Tracker;
+    PreservedAnalyses PA = applyPlan(Plan, Query, Tracker);
+    TypeCache.clear();
+    return PA;
+  }
+
   // Module pass to handle globals
   PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
     bool MadeChanges = false;
@@ -540,49 +4217,124 @@ struct TypeDowncaster : public PassInfoMixin<TypeDowncaster> {
         AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
     
     LLVM_DEBUG(dbgs() << "TypeDowncaster: Processing module " << M.getName() << "\n");
+
+    // Range facts that cross call boundaries. They are keyed by arguments
+    // and functions, which survive the rewrites below, so one computation
+    // serves every range query of this run. Specialized clones are created
+    // after that computation, so the ranges their call sites pass are kept
+    // on the side.
+    ArgumentRangeMap CloneArgs;
+    RangeQuery Query(FAM, &AM.getResult<InterproceduralRangeAnalysis>(M),
+                     &CloneArgs);
     
-    // Clear any previous data in the tracker
-    Tracker.clear();
+    // One tracker serves the whole run; clear() keeps its storage, so it is
+    // reused by every function
+    ReplacementTracker Tracker;
     
     // First step: Process global variables
+    std::vector<GlobalVariable *> Candidates;
     for (auto &GV : M.globals()) {
-      if (!GV.isDeclaration() && isEligibleForOptimization(GV.getValueType())) {
-        // Get any function to get ScalarEvolution (doesn't matter which)
-        Function *F = nullptr;
-        for (auto &Func : M) {
-          if (!Func.isDeclaration()) {
-            F = &Func;
-            break;
-          }
-        }
-        
-        if (!F) {
-          LLVM_DEBUG(dbgs() << "  No function found to analyze globals\n");
-          continue;
-        }
-        
-        ScalarEvolution &SE = FAM.getResult<ScalarEvolutionAnalysis>(*F);
-        
-        optimizeGlobal(&GV, SE, M);
-        ++NumGlobalsOptimized;
-        MadeChanges = true;
-        
-        LLVM_DEBUG(dbgs() << "  Optimized global variable: " << GV.getName() << "\n");
+      if (!GV.isDeclaration() && isEligibleForOptimization(GV.getValueType()))
+        Candidates.push_back(&GV);
+    }
+
+    SmallVector<GlobalValue *, 8> UsedVector;
+    collectUsedGlobalVariables(M, UsedVector, /*CompilerUsed=*/false);
+    collectUsedGlobalVariables(M, UsedVector, /*CompilerUsed=*/true);
+    SmallPtrSet<GlobalValue *, 8> UsedGlobals(UsedVector.begin(), UsedVector.end());
+    std::string InlineAsmText = Candidates.empty() ? "" : collectInlineAsmText(M);
+
+    SmallVector<SlotAccesses, 4> RoundingSlots;
+    for (GlobalVariable *GV : Candidates) {
+      // The original global is deleted afterwards, so it must not be visible
+      // outside this module, every use has to be one the rewriter can
+      // retarget, and every stored value has to fit
+      StringRef Reason;
+      ProofLog Log;
+      if (doesGlobalEscape(GV, UsedGlobals, InlineAsmText, Reason) ||
+          !isSafeToNarrowGlobal(GV, Query, Reason, Log, RoundingSlots)) {
+        ++NumGlobalsRejected;
+        LLVM_DEBUG(dbgs() << "  Kept global wide (" << Reason
+                          << "): " << GV->getName() << "\n");
+        continue;
+      }
+      
+      if (!optimizeGlobal(GV, M, Tracker)) {
+        ++NumGlobalsRejected;
+        continue;
       }
+      ++NumGlobalsOptimized;
+      if (Log.ByErrorBound)
+        Query.RoundedObjects.push_back(
+            Tracker.getGlobalReplacements().back().second);
+      recordProofs(Log);
+      MadeChanges = true;
+      
+      LLVM_DEBUG(dbgs() << "  Optimized global variable: " << GV->getName() << "\n");
+    }
+
+    // Second step: Redirect every load and store of the narrowed globals,
+    // then drop the originals. Analyses of the rewritten functions are stale
+    // from here on, so drop them before the functions are processed.
+    SmallPtrSet<Function *, 16> ChangedFunctions;
+    if (MadeChanges) {
+      rewriteGlobalUses(Tracker, ChangedFunctions);
+      Tracker.clear();
+      for (Function *F : ChangedFunctions)
+        FAM.invalidate(*F, getPreservedAnalysesForChange());
     }
     
-    // Process each function
+    // Clone functions for call sites that pass narrow arguments. This comes
+    // before the functions are processed, so the clones are processed too.
+    if (SpecializationBudget)
+      MadeChanges |= specializeCallSites(M, Query, CloneArgs);
+
+    // Process each function. Every plan is made before any function is
+    // rewritten, then the plans are applied in module order.
+    std::vector<FunctionPlan> Plans;
     for (auto &F : M) {
-      if (!F.isDeclaration()) {
-        PreservedAnalyses PA = run(F, FAM);
-        if (!PA.areAllPreserved())
-          MadeChanges = true;
+      if (F.isDeclaration())
+        continue;
+      Plans.emplace_back();
+      planFunction(F, Plans.back());
+    }
+
+    // applyPlan is called directly rather than through a pass manager, so
+    // its result has to be applied to FAM here
+    for (FunctionPlan &Plan : Plans) {
+      PreservedAnalyses PA = applyPlan(Plan, Query, Tracker);
+      if (!PA.areAllPreserved()) {
+        FAM.invalidate(*Plan.F, PA);
+        MadeChanges = true;
       }
     }
+
+    // Third step: Narrow the signatures of internal functions. Every plan is
+    // made before anything is rewritten, while the argument and return facts
+    // still describe the functions in the module.
+    SmallVector<SignaturePlan, 8> Signatures;
+    for (auto &F : M) {
+      SignaturePlan Plan;
+      if (planSignature(F, Query, Plan))
+        Signatures.push_back(std::move(Plan));
+    }
+    for (const SignaturePlan &Plan : Signatures) {
+      // The arguments are deleted with the function
+      for (Argument &Arg : Plan.F->args())
+        CloneArgs.erase(&Arg);
+      rewriteSignature(Plan, FAM);
+    }
+    MadeChanges |= !Signatures.empty();
+    TypeCache.clear();
     
     if (MadeChanges) {
       LLVM_DEBUG(dbgs() << "  Made changes to module " << M.getName() << "\n");
-      return PreservedAnalyses::none();
+      // Function analyses were invalidated precisely above; everything else
+      // at module level (globals changed) is dropped
+      PreservedAnalyses PA;
+      PA.preserveSet<AllAnalysesOn<Function>>();
+      PA.preserve<FunctionAnalysisManagerModuleProxy>();
+      return PA;
     }
     
     return PreservedAnalyses::all();
@@ -597,6 +4349,17 @@ llvmGetPassPluginInfo() {
   return {
     LLVM_PLUGIN_API_VERSION, "TypeDowncaster", "v1.0",
     [](PassBuilder &PB) {
+      PB.registerAnalysisRegistrationCallback(
+        [](ModuleAnalysisManager &MAM) {
+          MAM.registerPass([] { return InterproceduralRangeAnalysis(); });
+        }
+      );
+      PB.registerAnalysisRegistrationCallback(
+        [](FunctionAnalysisManager &FAM) {
+          FAM.registerPass([] { return IntervalRangeAnalysis(); });
+        }
+      );
+
       PB.registerPipelineParsingCallback(
         [](StringRef Name, FunctionPassManager &FPM,
            ArrayRef<PassBuilder::PipelineElement>) {
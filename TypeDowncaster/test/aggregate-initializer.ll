@@ -0,0 +1,39 @@
+; Struct, array and vector initializers are converted element by element.
+; Elements whose type is not narrowed are kept, and a global stays wide if
+; any element cannot be converted exactly.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -S %s | FileCheck %s
+
+%struct.P = type { i64, double, i16 }
+
+; CHECK-DAG: @point = internal global %struct.P.optimized { i32 -7, float 1.500000e+00, i16 3 }
+@point = internal global %struct.P { i64 -7, double 1.500000e+00, i16 3 }
+; CHECK-DAG: @nested = internal global [2 x %[[P:struct.P.optimized[.0-9]*]]] [%[[P]] { i32 1, float 2.500000e-01, i16 0 }, %[[P]] { i32 2, float -0.000000e+00, i16 undef }]
+@nested = internal global [2 x %struct.P] [%struct.P { i64 1, double 2.500000e-01, i16 0 }, %struct.P { i64 2, double -0.000000e+00, i16 undef }]
+; CHECK-DAG: @vec = internal global <2 x i32> <i32 5, i32 undef>
+@vec = internal global <2 x i64> <i64 5, i64 undef>
+
+; 0.1 is rounded by float
+; CHECK-DAG: @inexact = internal global %struct.P { i64 1, double 1.000000e-01, i16 0 }
+@inexact = internal global %struct.P { i64 1, double 1.000000e-01, i16 0 }
+; An address cannot be proven to fit
+; CHECK-DAG: @address = internal global %struct.P { i64 ptrtoint (i64* @anchor to i64), double 0.000000e+00, i16 0 }
+@address = internal global %struct.P { i64 ptrtoint (i64* @anchor to i64), double 0.000000e+00, i16 0 }
+@anchor = global i64 0
+
+define i64 @read(i64 %i) {
+  %p = getelementptr %struct.P, %struct.P* @point, i64 0, i32 0
+  %a = load i64, i64* %p
+  %q = getelementptr [2 x %struct.P], [2 x %struct.P]* @nested, i64 0, i64 %i, i32 0
+  %b = load i64, i64* %q
+  %r = getelementptr <2 x i64>, <2 x i64>* @vec, i64 0, i64 %i
+  %c = load i64, i64* %r
+  %s = getelementptr %struct.P, %struct.P* @inexact, i64 0, i32 0
+  %d = load i64, i64* %s
+  %t = getelementptr %struct.P, %struct.P* @address, i64 0, i32 0
+  %e = load i64, i64* %t
+  %s1 = add i64 %a, %b
+  %s2 = add i64 %s1, %c
+  %s3 = add i64 %s2, %d
+  %s4 = add i64 %s3, %e
+  ret i64 %s4
+}
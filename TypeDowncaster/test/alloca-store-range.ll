@@ -0,0 +1,54 @@
+; A stack slot is narrowed only when the joined range of every value stored
+; into it fits in i32.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes='function(type-downcaster)' -S %s | FileCheck %s
+
+; CHECK-LABEL: @constants(
+; CHECK: %slot.optimized = alloca i32
+; CHECK: store i32 5, i32* %slot.optimized
+; CHECK: store i32 -7, i32* %slot.optimized
+; CHECK: load i32, i32* %slot.optimized
+define i64 @constants(i1 %c) {
+entry:
+  %slot = alloca i64
+  store i64 5, i64* %slot
+  br i1 %c, label %then, label %exit
+
+then:
+  store i64 -7, i64* %slot
+  br label %exit
+
+exit:
+  %r = load i64, i64* %slot
+  ret i64 %r
+}
+
+; 2^33 does not fit in i32
+; CHECK-LABEL: @too_wide(
+; CHECK: %slot = alloca i64
+; CHECK-NOT: alloca i32
+define i64 @too_wide(i1 %c) {
+entry:
+  %slot = alloca i64
+  store i64 5, i64* %slot
+  br i1 %c, label %then, label %exit
+
+then:
+  store i64 8589934592, i64* %slot
+  br label %exit
+
+exit:
+  %r = load i64, i64* %slot
+  ret i64 %r
+}
+
+; Nothing is known about %x
+; CHECK-LABEL: @unknown(
+; CHECK: %slot = alloca i64
+; CHECK-NOT: alloca i32
+define i64 @unknown(i64 %x) {
+entry:
+  %slot = alloca i64
+  store i64 %x, i64* %slot
+  %r = load i64, i64* %slot
+  ret i64 %r
+}
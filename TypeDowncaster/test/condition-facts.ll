@@ -0,0 +1,108 @@
+; Branch conditions that dominate a store, and llvm.assume calls that hold
+; at it, bound the stored value.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes='function(type-downcaster)' -S %s | FileCheck %s
+
+declare void @llvm.assume(i1)
+
+; CHECK-LABEL: @guarded(
+; CHECK: %slot.optimized = alloca i32
+define i64 @guarded(i64 %i) {
+entry:
+  %slot = alloca i64
+  store i64 0, i64* %slot
+  %lo = icmp sge i64 %i, -5000
+  %hi = icmp slt i64 %i, 5000
+  %in = and i1 %lo, %hi
+  br i1 %in, label %then, label %exit
+
+then:
+  %d = mul nsw i64 %i, 3
+  store i64 %d, i64* %slot
+  br label %exit
+
+exit:
+  %r = load i64, i64* %slot
+  ret i64 %r
+}
+
+; CHECK-LABEL: @assumed(
+; CHECK: %slot.optimized = alloca i32
+define i64 @assumed(i64 %i) {
+entry:
+  %slot = alloca i64
+  %small = icmp ult i64 %i, 100000
+  call void @llvm.assume(i1 %small)
+  store i64 %i, i64* %slot
+  %r = load i64, i64* %slot
+  ret i64 %r
+}
+
+; The case value of the switch bounds %i more tightly than the branch below
+; it, and the two facts are intersected
+; CHECK-LABEL: @switch_case(
+; CHECK: %slot.optimized = alloca i32
+define i64 @switch_case(i64 %i) {
+entry:
+  %slot = alloca i64
+  store i64 0, i64* %slot
+  %next = add i64 %i, 1
+  %big = shl i64 %next, 20
+  switch i64 %i, label %exit [
+    i64 7, label %seven
+  ]
+
+seven:
+  %small = icmp slt i64 %i, 1099511627776
+  br i1 %small, label %then, label %exit
+
+then:
+  store i64 %big, i64* %slot
+  br label %exit
+
+exit:
+  %r = load i64, i64* %slot
+  ret i64 %r
+}
+
+; The bound only holds on the edge that is not taken to the store
+; CHECK-LABEL: @wrong_edge(
+; CHECK: %slot = alloca i64
+; CHECK-NOT: alloca i32
+define i64 @wrong_edge(i64 %i) {
+entry:
+  %slot = alloca i64
+  store i64 0, i64* %slot
+  %small = icmp ult i64 %i, 100000
+  br i1 %small, label %exit, label %then
+
+then:
+  store i64 %i, i64* %slot
+  br label %exit
+
+exit:
+  %r = load i64, i64* %slot
+  ret i64 %r
+}
+
+; The condition is only known in a block that does not dominate the store
+; CHECK-LABEL: @not_dominating(
+; CHECK: %slot = alloca i64
+; CHECK-NOT: alloca i32
+define i64 @not_dominating(i64 %i, i1 %c) {
+entry:
+  %slot = alloca i64
+  store i64 0, i64* %slot
+  br i1 %c, label %check, label %join
+
+check:
+  %small = icmp ult i64 %i, 100000
+  br i1 %small, label %join, label %exit
+
+join:
+  store i64 %i, i64* %slot
+  br label %exit
+
+exit:
+  %r = load i64, i64* %slot
+  ret i64 %r
+}
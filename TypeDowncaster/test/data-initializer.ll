@@ -0,0 +1,39 @@
+; Arrays of i64 and double are converted in bulk, and only when every
+; element survives the conversion exactly.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -S %s | FileCheck %s
+
+; CHECK-DAG: @ints = internal global [4 x i32] [i32 1, i32 -2, i32 2147483647, i32 -2147483648]
+@ints = internal global [4 x i64] [i64 1, i64 -2, i64 2147483647, i64 -2147483648]
+; CHECK-DAG: @doubles = internal global [3 x float] [float 5.000000e-01, float -2.500000e-01, float 0x7FF0000000000000]
+@doubles = internal global [3 x double] [double 5.000000e-01, double -2.500000e-01, double 0x7FF0000000000000]
+
+; 2^31 does not fit in i32
+; CHECK-DAG: @wide_ints = internal global [2 x i64] [i64 1, i64 2147483648]
+@wide_ints = internal global [2 x i64] [i64 1, i64 2147483648]
+; 0.1 is rounded by float
+; CHECK-DAG: @inexact = internal global [2 x double] [double 1.000000e+00, double 1.000000e-01]
+@inexact = internal global [2 x double] [double 1.000000e+00, double 1.000000e-01]
+; 1e300 is finite but beyond the float range
+; CHECK-DAG: @huge = internal global [2 x double] [double 1.000000e+00, double 1.000000e+300]
+@huge = internal global [2 x double] [double 1.000000e+00, double 1.000000e+300]
+
+define i64 @read_ints(i64 %i) {
+  %p = getelementptr [4 x i64], [4 x i64]* @ints, i64 0, i64 %i
+  %v = load i64, i64* %p
+  %q = getelementptr [2 x i64], [2 x i64]* @wide_ints, i64 0, i64 %i
+  %w = load i64, i64* %q
+  %s = add i64 %v, %w
+  ret i64 %s
+}
+
+define double @read_doubles(i64 %i) {
+  %p = getelementptr [3 x double], [3 x double]* @doubles, i64 0, i64 %i
+  %a = load double, double* %p
+  %q = getelementptr [2 x double], [2 x double]* @inexact, i64 0, i64 %i
+  %b = load double, double* %q
+  %r = getelementptr [2 x double], [2 x double]* @huge, i64 0, i64 %i
+  %c = load double, double* %r
+  %s = fadd double %a, %b
+  %t = fadd double %s, %c
+  ret double %t
+}
@@ -0,0 +1,41 @@
+; A slot whose stored values do not fit in i32 is still narrowed when no
+; reader observes the upper half of what it loads.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes='function(type-downcaster)' -S %s | FileCheck %s
+
+; CHECK-LABEL: @truncated_readers(
+; CHECK: %slot.optimized = alloca i32
+define i32 @truncated_readers(i64 %x, i1 %c) {
+entry:
+  %slot = alloca i64
+  %wide = mul i64 %x, %x
+  store i64 %wide, i64* %slot
+  %a = load i64, i64* %slot
+  %lo = trunc i64 %a to i32
+  br i1 %c, label %then, label %exit
+
+then:
+  %b = load i64, i64* %slot
+  %byte = trunc i64 %b to i8
+  %ext = zext i8 %byte to i32
+  br label %exit
+
+exit:
+  %r = phi i32 [ %lo, %entry ], [ %ext, %then ]
+  ret i32 %r
+}
+
+; The second reader returns all 64 bits
+; CHECK-LABEL: @full_reader(
+; CHECK: %slot = alloca i64
+; CHECK-NOT: alloca i32
+define i64 @full_reader(i64 %x, i32* %out) {
+entry:
+  %slot = alloca i64
+  %wide = mul i64 %x, %x
+  store i64 %wide, i64* %slot
+  %a = load i64, i64* %slot
+  %lo = trunc i64 %a to i32
+  store i32 %lo, i32* %out
+  %b = load i64, i64* %slot
+  ret i64 %b
+}
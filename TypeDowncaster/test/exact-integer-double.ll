@@ -0,0 +1,29 @@
+; A double converted from an integer of at most 2^24 in magnitude is exact
+; in float, so its slot can be narrowed.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes='function(type-downcaster)' -S %s | FileCheck %s
+
+; CHECK-LABEL: @small_integer(
+; CHECK: %slot.optimized = alloca float
+define double @small_integer(i64 %x) {
+entry:
+  %slot = alloca double
+  %m = and i64 %x, 65535
+  %d = sitofp i64 %m to double
+  store double %d, double* %slot
+  %r = load double, double* %slot
+  ret double %r
+}
+
+; Values up to 2^25 - 1 lose their low bit in float
+; CHECK-LABEL: @too_many_bits(
+; CHECK: %slot = alloca double
+; CHECK-NOT: alloca float
+define double @too_many_bits(i64 %x) {
+entry:
+  %slot = alloca double
+  %m = and i64 %x, 33554431
+  %d = sitofp i64 %m to double
+  store double %d, double* %slot
+  %r = load double, double* %slot
+  ret double %r
+}
@@ -0,0 +1,42 @@
+; A rounded value stored to memory the pass does not narrow can no longer be
+; followed, so the slot it comes from must stay double. A copy of a rounded
+; slot into another slot is fine: both are narrowed together.
+; RUN: opt -load=%shlibdir/TypeDowncaster%shlibext -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -type-downcaster-fp-tolerance=1e-3 -S %s | FileCheck %s
+
+; The reloaded value minus the original is exactly 0 in the source, but pure
+; rounding error if %slot were narrowed
+; CHECK-LABEL: @reload(
+; CHECK: %slot = alloca double
+; CHECK-NOT: alloca float
+define double @reload(double* %out, i32 %i) {
+entry:
+  %slot = alloca double
+  %k = and i32 %i, 1023
+  %k1 = add i32 %k, 1
+  %c = sitofp i32 %k1 to double
+  %orig = fmul double %c, 1.000000e-01
+  store double %orig, double* %slot
+  %l = load double, double* %slot
+  store double %l, double* %out
+  %reloaded = load double, double* %out
+  %d = fsub double %reloaded, %orig
+  ret double %d
+}
+
+; CHECK-LABEL: @copied(
+; CHECK-DAG: %slot.optimized = alloca float
+; CHECK-DAG: %copy.optimized = alloca float
+define void @copied(i32 %i) {
+entry:
+  %slot = alloca double
+  %copy = alloca double
+  %k = and i32 %i, 1023
+  %k1 = add i32 %k, 1
+  %c = sitofp i32 %k1 to double
+  %orig = fmul double %c, 1.000000e-01
+  store double %orig, double* %slot
+  %l = load double, double* %slot
+  %m = fmul double %l, 2.000000e+00
+  store double %m, double* %copy
+  ret void
+}
@@ -0,0 +1,91 @@
+; With a relative error tolerance, double slots and globals holding values
+; that float cannot represent exactly are narrowed when the rounding error
+; of every value computed from them stays within the tolerance. Rounding
+; k * 0.1 to float costs up to 2^-24 (6e-8) relative error, which is below
+; the 1e-7 used here, but twice that is not.
+; RUN: opt -load=%shlibdir/TypeDowncaster%shlibext -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -type-downcaster-fp-tolerance=1e-7 -S %s | FileCheck %s
+
+; Rounded, and read in @mix and @report
+; CHECK: @g = internal global float 0.000000e+00
+@g = internal global double 0.000000e+00
+
+; Read in @report and passed to a call, where the error can no longer be
+; followed
+; CHECK: @h = internal global double 0.000000e+00
+@h = internal global double 0.000000e+00
+
+declare void @use(double)
+
+define void @set(i32 %i) {
+entry:
+  %k = and i32 %i, 1023
+  %k1 = add i32 %k, 1
+  %c = sitofp i32 %k1 to double
+  %v = fmul double %c, 1.000000e-01
+  store double %v, double* @g
+  store double %v, double* @h
+  ret void
+}
+
+; One rounding
+; CHECK-LABEL: @within(
+; CHECK: %slot.optimized = alloca float
+define void @within(i32 %i) {
+entry:
+  %slot = alloca double
+  %k = and i32 %i, 1023
+  %k1 = add i32 %k, 1
+  %c = sitofp i32 %k1 to double
+  %v = fmul double %c, 1.000000e-01
+  store double %v, double* %slot
+  %l = load double, double* %slot
+  %m = fmul double %l, 1.500000e+00
+  ret void
+}
+
+; The square doubles the error
+; CHECK-LABEL: @above(
+; CHECK: %slot = alloca double
+; CHECK-NOT: alloca float
+define void @above(i32 %i) {
+entry:
+  %slot = alloca double
+  %k = and i32 %i, 1023
+  %k1 = add i32 %k, 1
+  %c = sitofp i32 %k1 to double
+  %v = fmul double %c, 1.000000e-01
+  store double %v, double* %slot
+  %l = load double, double* %slot
+  %m = fmul double %l, %l
+  ret void
+}
+
+; The product of the rounded @g and the slot would carry both errors, so
+; the slot stays double once @g is float
+; CHECK-LABEL: @mix(
+; CHECK: %slot = alloca double
+; CHECK-NOT: alloca float
+define void @mix(i32 %i) {
+entry:
+  %slot = alloca double
+  %k = and i32 %i, 1023
+  %k1 = add i32 %k, 1
+  %c = sitofp i32 %k1 to double
+  %v = fmul double %c, 1.000000e-01
+  store double %v, double* %slot
+  %l = load double, double* %slot
+  %lg = load double, double* @g
+  %m = fmul double %l, %lg
+  ret void
+}
+
+; CHECK-LABEL: @report(
+; CHECK: load float, float* @g
+; CHECK: load double, double* @h
+define void @report() {
+entry:
+  %lg = load double, double* @g
+  %lh = load double, double* @h
+  call void @use(double %lh)
+  ret void
+}
@@ -0,0 +1,61 @@
+; Globals are only narrowed when every reader and writer is visible in the
+; IR. Assembly refers to the emitted symbol, which carries the "_" prefix
+; on Mach-O.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -S %s | FileCheck %s
+
+target datalayout = "e-m:o-i64:64-i128:128-n32:64-S128"
+
+module asm "\09.globl _read_module"
+module asm "\09ldr x0, _in_module_asm"
+
+; CHECK-DAG: @local = internal global i32 0
+@local = internal global i64 0
+; Only a longer symbol that starts with its name is in the assembly
+; CHECK-DAG: @in_call = internal global i32 0
+@in_call = internal global i64 0
+
+; CHECK-DAG: @external = global i64 0
+@external = global i64 0
+; CHECK-DAG: @used = internal global i64 0
+@used = internal global i64 0
+; CHECK-DAG: @compiler_used = internal global i64 0
+@compiler_used = internal global i64 0
+; CHECK-DAG: @in_section = internal global i64 0, section "__DATA,__keep"
+@in_section = internal global i64 0, section "__DATA,__keep"
+; CHECK-DAG: @in_call_asm = internal global i64 0
+@in_call_asm = internal global i64 0
+; CHECK-DAG: @in_module_asm = internal global i64 0
+@in_module_asm = internal global i64 0
+
+@llvm.used = appending global [1 x i8*] [i8* bitcast (i64* @used to i8*)], section "llvm.metadata"
+@llvm.compiler.used = appending global [1 x i8*] [i8* bitcast (i64* @compiler_used to i8*)], section "llvm.metadata"
+
+define i64 @touch(i32 %n) {
+  %m = and i32 %n, 255
+  %v = zext i32 %m to i64
+  store i64 %v, i64* @local
+  store i64 %v, i64* @in_call
+  store i64 %v, i64* @external
+  store i64 %v, i64* @used
+  store i64 %v, i64* @compiler_used
+  store i64 %v, i64* @in_section
+  store i64 %v, i64* @in_call_asm
+  store i64 %v, i64* @in_module_asm
+  call void asm sideeffect "ldr x0, _in_call_asm\0Aldr x1, _in_call2", ""()
+  %a = load i64, i64* @local
+  %b = load i64, i64* @in_call
+  %c = load i64, i64* @external
+  %d = load i64, i64* @used
+  %e = load i64, i64* @compiler_used
+  %f = load i64, i64* @in_section
+  %g = load i64, i64* @in_call_asm
+  %h = load i64, i64* @in_module_asm
+  %s1 = add i64 %a, %b
+  %s2 = add i64 %s1, %c
+  %s3 = add i64 %s2, %d
+  %s4 = add i64 %s3, %e
+  %s5 = add i64 %s4, %f
+  %s6 = add i64 %s5, %g
+  %s7 = add i64 %s6, %h
+  ret i64 %s7
+}
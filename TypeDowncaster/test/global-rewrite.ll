@@ -0,0 +1,44 @@
+; Narrowed globals are rewritten in a module-level stage: every load and
+; store, including those through constant GEP expressions, is retargeted,
+; and the narrowed global keeps the name, alignment and metadata of the
+; original. Its !dbg variable described the wide type and is dropped.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -S %s | FileCheck %s
+
+; CHECK-DAG: @count = internal global i32 0, align 16, !note ![[NOTE:[0-9]+]]{{$}}
+@count = internal global i64 0, align 16, !dbg !5, !note !9
+; CHECK-DAG: @pair = internal global [2 x float] zeroinitializer
+@pair = internal global [2 x double] zeroinitializer
+; The stored value is unknown
+; CHECK-DAG: @wide = internal global i64 0, !dbg
+@wide = internal global i64 0, !dbg !8
+
+; CHECK-LABEL: @bump(
+; CHECK: load i32, i32* @count
+; CHECK: store i32 %{{.*}}, i32* @count
+; CHECK: store float 2.500000e+00, float* getelementptr inbounds ([2 x float], [2 x float]* @pair, i64 0, i64 1)
+; CHECK: store i64 %x, i64* @wide
+define i64 @bump(i32 %n, i64 %x) {
+  %v = load i64, i64* @count
+  %m = and i32 %n, 255
+  %e = zext i32 %m to i64
+  store i64 %e, i64* @count
+  store double 2.500000e+00, double* getelementptr inbounds ([2 x double], [2 x double]* @pair, i64 0, i64 1)
+  store i64 %x, i64* @wide
+  %w = load i64, i64* @wide
+  %s = add i64 %v, %w
+  ret i64 %s
+}
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!4}
+
+!0 = distinct !DICompileUnit(language: DW_LANG_C99, file: !1, producer: "test", isOptimized: true, runtimeVersion: 0, emissionKind: FullDebug, globals: !2)
+!1 = !DIFile(filename: "global-rewrite.c", directory: "/")
+!2 = !{!5, !8}
+!3 = !DIBasicType(name: "long", size: 64, encoding: DW_ATE_signed)
+!4 = !{i32 2, !"Debug Info Version", i32 3}
+!5 = !DIGlobalVariableExpression(var: !6, expr: !DIExpression())
+!6 = distinct !DIGlobalVariable(name: "count", scope: !0, file: !1, line: 1, type: !3, isLocal: true, isDefinition: true)
+!7 = distinct !DIGlobalVariable(name: "wide", scope: !0, file: !1, line: 2, type: !3, isLocal: true, isDefinition: true)
+!8 = !DIGlobalVariableExpression(var: !7, expr: !DIExpression())
+!9 = !{!"kept"}
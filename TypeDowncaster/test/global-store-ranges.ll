@@ -0,0 +1,32 @@
+; A global is narrowed only when the stores of every function in the
+; module fit, each analyzed in the function that stores it.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -S %s | FileCheck %s
+
+; CHECK-DAG: @both_fit = internal global i32 0
+@both_fit = internal global i64 0
+; CHECK-DAG: @one_wide = internal global i64 0
+@one_wide = internal global i64 0
+
+define void @store_small(i32 %n) {
+  %m = and i32 %n, 4095
+  %v = zext i32 %m to i64
+  store i64 %v, i64* @both_fit
+  store i64 %v, i64* @one_wide
+  ret void
+}
+
+; The quotient is below 2^24; shifted left by 20 it no longer fits
+define void @store_scaled(i64 %i) {
+  %q = udiv i64 %i, 1099511627776
+  store i64 %q, i64* @both_fit
+  %big = shl i64 %q, 20
+  store i64 %big, i64* @one_wide
+  ret void
+}
+
+define i64 @read() {
+  %a = load i64, i64* @both_fit
+  %b = load i64, i64* @one_wide
+  %s = add i64 %a, %b
+  ret i64 %s
+}
@@ -0,0 +1,40 @@
+; In module mode, ranges flow from call sites into the parameters of local
+; functions and from returns back into callers.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -S %s | FileCheck %s
+
+; Every call passes a value in [0, 255], so the result is in [0, 1020]
+define internal i64 @scale(i64 %a) {
+entry:
+  %m = mul i64 %a, 4
+  ret i64 %m
+}
+
+define i64 @unbounded(i64 %x) {
+entry:
+  %s = shl i64 %x, 40
+  ret i64 %s
+}
+
+; CHECK-LABEL: @through_call(
+; CHECK: %slot.optimized = alloca i32
+define i64 @through_call(i64 %x) {
+entry:
+  %slot = alloca i64
+  %a = and i64 %x, 255
+  %v = call i64 @scale(i64 %a)
+  store i64 %v, i64* %slot
+  %r = load i64, i64* %slot
+  ret i64 %r
+}
+
+; CHECK-LABEL: @unbounded_return(
+; CHECK: %slot = alloca i64
+; CHECK-NOT: alloca i32
+define i64 @unbounded_return(i64 %x) {
+entry:
+  %slot = alloca i64
+  %v = call i64 @unbounded(i64 %x)
+  store i64 %v, i64* %slot
+  %r = load i64, i64* %slot
+  ret i64 %r
+}
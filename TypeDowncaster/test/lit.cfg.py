@@ -0,0 +1,24 @@
+# -*- Python -*-
+
+import os
+
+import lit.formats
+from lit.llvm import llvm_config
+
+config.name = 'TypeDowncaster'
+config.test_format = lit.formats.ShTest(not llvm_config.use_lit_shell)
+config.suffixes = ['.ll']
+
+config.test_source_root = os.path.dirname(__file__)
+config.test_exec_root = config.typedowncaster_obj_root
+
+# %shlibdir/TypeDowncaster%shlibext is the plugin built by this tree
+config.substitutions.append(('%shlibdir', config.typedowncaster_plugin_dir))
+config.substitutions.append(('%shlibext', config.typedowncaster_shlibext))
+
+# Tests of the SMT proof mode need a plugin built with Z3
+if config.typedowncaster_have_smt:
+    config.available_features.add('z3')
+
+llvm_config.add_tool_substitutions(['opt', 'FileCheck', 'not'],
+                                   [config.llvm_tools_dir])
@@ -0,0 +1,56 @@
+; A slot that a loop with a known trip count increments by a bounded step is
+; bounded by its initial value plus trip count times step.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes='function(type-downcaster)' -S %s | FileCheck %s
+
+; count += x[i] & 0xff, 1000 times, stays below 255000
+; CHECK-LABEL: @count_bytes(
+; CHECK: %c.optimized = alloca i32
+define i64 @count_bytes(i64* %x) {
+entry:
+  %c = alloca i64
+  store i64 0, i64* %c
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %p = getelementptr inbounds i64, i64* %x, i64 %i
+  %v = load i64, i64* %p
+  %byte = and i64 %v, 255
+  %old = load i64, i64* %c
+  %new = add i64 %old, %byte
+  store i64 %new, i64* %c
+  %i.next = add nuw nsw i64 %i, 1
+  %done = icmp eq i64 %i.next, 1000
+  br i1 %done, label %exit, label %loop
+
+exit:
+  %r = load i64, i64* %c
+  ret i64 %r
+}
+
+; Without a known trip count the sum is unbounded
+; CHECK-LABEL: @count_bytes_n(
+; CHECK: %c = alloca i64
+; CHECK-NOT: alloca i32
+define i64 @count_bytes_n(i64* %x, i64 %n) {
+entry:
+  %c = alloca i64
+  store i64 0, i64* %c
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %p = getelementptr inbounds i64, i64* %x, i64 %i
+  %v = load i64, i64* %p
+  %byte = and i64 %v, 255
+  %old = load i64, i64* %c
+  %new = add i64 %old, %byte
+  store i64 %new, i64* %c
+  %i.next = add nuw nsw i64 %i, 1
+  %done = icmp eq i64 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  %r = load i64, i64* %c
+  ret i64 %r
+}
@@ -0,0 +1,29 @@
+; Function mode runs the pass once per function and drops the type cache in
+; between, but a named struct still gets a single narrowed counterpart.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes='function(type-downcaster)' -S %s | FileCheck %s
+
+%struct.S = type { i64, double }
+
+; CHECK: %struct.S.optimized = type { i32, float }
+; CHECK-NOT: %struct.S.optimized.0
+
+; CHECK-LABEL: @first(
+; CHECK: alloca %struct.S.optimized
+define i64 @first(i32 %x) {
+  %s = alloca %struct.S
+  %f = getelementptr %struct.S, %struct.S* %s, i64 0, i32 0
+  %e = sext i32 %x to i64
+  store i64 %e, i64* %f
+  %v = load i64, i64* %f
+  ret i64 %v
+}
+
+; CHECK-LABEL: @second(
+; CHECK: alloca %struct.S.optimized
+define double @second() {
+  %s = alloca %struct.S
+  %f = getelementptr %struct.S, %struct.S* %s, i64 0, i32 1
+  store double 2.500000e+00, double* %f
+  %v = load double, double* %f
+  ret double %v
+}
@@ -0,0 +1,54 @@
+; Chains of i64 arithmetic run in i32 when every value that leaves the
+; chain is truncated, compared, or proven to fit.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -S %s | FileCheck %s
+
+; CHECK-LABEL: @fits(
+; CHECK: mul i32
+; CHECK: add i32
+; CHECK: sext i32 %{{.*}} to i64
+; CHECK-NOT: mul i64
+define i64 @fits(i32 %a, i32 %b) {
+  %x = zext i32 %a to i64
+  %y = zext i32 %b to i64
+  %xm = and i64 %x, 1023
+  %ym = and i64 %y, 1023
+  %p = mul i64 %xm, %ym
+  %s = add i64 %p, %xm
+  ret i64 %s
+}
+
+; Only the low half is used, whatever the range
+; CHECK-LABEL: @truncated(
+; CHECK: mul i32
+; CHECK-NEXT: add i32
+; CHECK-NEXT: ret i32
+define i32 @truncated(i32 %a, i32 %b) {
+  %x = sext i32 %a to i64
+  %y = sext i32 %b to i64
+  %p = mul i64 %x, %y
+  %s = add i64 %p, %x
+  %t = trunc i64 %s to i32
+  ret i32 %t
+}
+
+; The product of two 20-bit values can overflow i32
+; CHECK-LABEL: @overflows(
+; CHECK: mul i64
+; CHECK: add i64
+; CHECK-NOT: downcasted
+define i64 @overflows(i64 %a, i64 %b) {
+  %x = and i64 %a, 1048575
+  %y = and i64 %b, 1048575
+  %p = mul i64 %x, %y
+  %s = add i64 %p, %x
+  ret i64 %s
+}
+
+; Truncating the operands would cost as much as the addition
+; CHECK-LABEL: @unprofitable(
+; CHECK: add i64
+define i32 @unprofitable(i64 %a, i64 %b) {
+  %s = add i64 %a, %b
+  %t = trunc i64 %s to i32
+  ret i32 %t
+}
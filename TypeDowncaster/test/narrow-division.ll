@@ -0,0 +1,73 @@
+; i64 divisions and remainders run in i32 when both operands are proven to
+; fit and INT32_MIN / -1 cannot happen. With guarded divisions, a division
+; with one proven operand checks the other one at run time.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -S %s | FileCheck %s --check-prefixes=CHECK,PLAIN
+; RUN: opt -load=%shlibdir/TypeDowncaster%shlibext -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -type-downcaster-guarded-division -S %s | FileCheck %s --check-prefixes=CHECK,GUARD
+
+; CHECK-LABEL: @proven(
+; CHECK: sdiv i32
+; CHECK: sext i32
+; CHECK: urem i32
+; CHECK: zext i32
+; CHECK-NOT: i64 %x, %y
+define i64 @proven(i32 %a, i32 %b) {
+  %x = sext i32 %a to i64
+  %m = and i32 %b, 1023
+  %m1 = add nuw nsw i32 %m, 1
+  %y = zext i32 %m1 to i64
+  %q = sdiv i64 %x, %y
+  %xm = and i64 %x, 65535
+  %r = urem i64 %xm, %y
+  %s = add i64 %q, %r
+  ret i64 %s
+}
+
+; Both operands fit, but INT32_MIN / -1 overflows in i32
+; CHECK-LABEL: @minus_one(
+; PLAIN: %q = sdiv i64 %x, %y
+; PLAIN-NOT: sdiv i32
+; GUARD: [[COND:%[0-9]+]] = icmp ne i64 %y, -1
+; GUARD-NEXT: br i1 [[COND]], label %[[FAST:[0-9A-Za-z.]+]], label %[[SLOW:[0-9A-Za-z.]+]]
+; GUARD: [[FAST]]:
+; GUARD: sdiv i32
+; GUARD: [[SLOW]]:
+; GUARD: sdiv i64 %x, %y
+; GUARD: %q = phi i64
+define i64 @minus_one(i32 %a, i32 %b) {
+  %x = sext i32 %a to i64
+  %y = sext i32 %b to i64
+  %q = sdiv i64 %x, %y
+  ret i64 %q
+}
+
+; Only the divisor is proven
+; CHECK-LABEL: @unsigned_dividend(
+; PLAIN: %q = udiv i64 %x, %y
+; PLAIN-NOT: udiv i32
+; GUARD: [[COND:%[0-9]+]] = icmp ult i64 %x, 4294967296
+; GUARD-NEXT: br i1 [[COND]], label %[[FAST:[0-9A-Za-z.]+]], label %[[SLOW:[0-9A-Za-z.]+]]
+; GUARD: [[FAST]]:
+; GUARD: udiv i32
+; GUARD: [[SLOW]]:
+; GUARD: udiv i64 %x, %y
+; GUARD: %q = phi i64
+define i64 @unsigned_dividend(i64 %x, i32 %b) {
+  %m = and i32 %b, 1023
+  %m1 = add nuw nsw i32 %m, 1
+  %y = zext i32 %m1 to i64
+  %q = udiv i64 %x, %y
+  ret i64 %q
+}
+
+; Nothing is proven, and constant divisors are left to the backend
+; CHECK-LABEL: @unknown(
+; CHECK: sdiv i64 %x, %y
+; CHECK: srem i64 %x, 7
+; CHECK-NOT: i32
+; CHECK: ret i64
+define i64 @unknown(i64 %x, i64 %y) {
+  %q = sdiv i64 %x, %y
+  %r = srem i64 %x, 7
+  %s = xor i64 %q, %r
+  ret i64 %s
+}
@@ -0,0 +1,55 @@
+; Parameters and return values of internal functions are narrowed when
+; every call passes, and every return returns, a value that fits.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -S %s | FileCheck %s
+
+; CHECK-LABEL: define internal i32 @narrow(i32 %x, float %d)
+; CHECK-NEXT: sext i32 %x to i64
+; CHECK-NEXT: fpext float %d to double
+; CHECK: trunc i64 %{{.*}} to i32
+; CHECK-NEXT: ret i32
+define internal i64 @narrow(i64 %x, double %d) {
+  %s = fptosi double %d to i64
+  %a = add nsw i64 %x, %s
+  %r = and i64 %a, 65535
+  ret i64 %r
+}
+
+; One call passes an unknown value for %y, and the result is unknown
+; CHECK-LABEL: define internal i64 @mixed(i32 %x, i64 %y)
+define internal i64 @mixed(i64 %x, i64 %y) {
+  %r = add i64 %x, %y
+  ret i64 %r
+}
+
+; Externally visible functions may have callers elsewhere
+; CHECK-LABEL: define i64 @external(i64 %x)
+define i64 @external(i64 %x) {
+  ret i64 %x
+}
+
+; The address is taken, so not every call is visible
+; CHECK-LABEL: define internal i64 @address_taken(i64 %x)
+define internal i64 @address_taken(i64 %x) {
+  ret i64 %x
+}
+
+@fp = global i64 (i64)* @address_taken
+
+; CHECK-LABEL: define i64 @caller(
+; CHECK: %a = call i32 @narrow(i32 %{{.*}}, float 2.500000e+00)
+; CHECK-NEXT: sext i32 %a to i64
+; CHECK: call i64 @mixed(i32 %{{.*}}, i64 %u)
+; CHECK: call i64 @mixed(i32 7, i64 %u)
+; CHECK: call i64 @address_taken(i64 %m)
+define i64 @caller(i32 %n, i64 %u) {
+  %m32 = and i32 %n, 1023
+  %m = zext i32 %m32 to i64
+  %a = call i64 @narrow(i64 %m, double 2.500000e+00)
+  %b = call i64 @mixed(i64 %m, i64 %u)
+  %c = call i64 @mixed(i64 7, i64 %u)
+  %e = call i64 @address_taken(i64 %m)
+  %s1 = add i64 %a, %b
+  %s2 = add i64 %s1, %c
+  %s3 = add i64 %s2, %e
+  ret i64 %s3
+}
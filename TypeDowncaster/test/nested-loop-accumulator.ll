@@ -0,0 +1,35 @@
+; An accumulator incremented in an inner loop with an unknown trip count is
+; not bounded by the trip count of the outer loop, so it must stay i64.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -S %s | FileCheck %s
+
+; CHECK-LABEL: @accumulate(
+; CHECK: %acc = alloca i64
+; CHECK-NOT: alloca i32
+define i64 @accumulate(i64 %n) {
+entry:
+  %acc = alloca i64
+  store i64 0, i64* %acc
+  br label %outer
+
+outer:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %outer.latch ]
+  br label %inner
+
+inner:
+  %j = phi i64 [ 0, %outer ], [ %j.next, %inner ]
+  %v = load i64, i64* %acc
+  %v.next = add i64 %v, 1000
+  store i64 %v.next, i64* %acc
+  %j.next = add i64 %j, 1
+  %inner.done = icmp sge i64 %j.next, %n
+  br i1 %inner.done, label %outer.latch, label %inner
+
+outer.latch:
+  %i.next = add i32 %i, 1
+  %outer.done = icmp eq i32 %i.next, 10
+  br i1 %outer.done, label %exit, label %outer
+
+exit:
+  %r = load i64, i64* %acc
+  ret i64 %r
+}
@@ -0,0 +1,18 @@
+; The plugin loads in both pass modes and leaves a function without i64 or
+; double slots as it is.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -S %s | FileCheck %s
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes='function(type-downcaster)' -S %s | FileCheck %s
+
+; CHECK-LABEL: @no_candidates(
+; CHECK-NEXT: entry:
+; CHECK-NEXT: %slot = alloca i32
+; CHECK-NEXT: store i32 %x, i32* %slot
+; CHECK-NEXT: %r = load i32, i32* %slot
+; CHECK-NEXT: ret i32 %r
+define i32 @no_candidates(i32 %x) {
+entry:
+  %slot = alloca i32
+  store i32 %x, i32* %slot
+  %r = load i32, i32* %slot
+  ret i32 %r
+}
@@ -0,0 +1,60 @@
+; Each range source bounds %i on one side only: ScalarEvolution knows the
+; induction variable is non-negative, and LazyValueInfo knows the branch
+; keeps it below 1000. Their intersection fits in i32.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes='function(type-downcaster)' -S %s | FileCheck %s
+
+; CHECK-LABEL: @both_bounds(
+; CHECK: %slot.optimized = alloca i32
+define i64 @both_bounds(i64 %n) {
+entry:
+  %slot = alloca i64
+  store i64 0, i64* %slot
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %latch ]
+  %small = icmp slt i64 %i, 1000
+  br i1 %small, label %then, label %latch
+
+then:
+  store i64 %i, i64* %slot
+  br label %latch
+
+latch:
+  %i.next = add nuw nsw i64 %i, 1
+  %done = icmp eq i64 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  %r = load i64, i64* %slot
+  ret i64 %r
+}
+
+; Only the upper bound is known
+; CHECK-LABEL: @upper_bound_only(
+; CHECK: %slot = alloca i64
+; CHECK-NOT: alloca i32
+define i64 @upper_bound_only(i64 %n, i64 %start) {
+entry:
+  %slot = alloca i64
+  store i64 0, i64* %slot
+  br label %loop
+
+loop:
+  %i = phi i64 [ %start, %entry ], [ %i.next, %latch ]
+  %small = icmp slt i64 %i, 1000
+  br i1 %small, label %then, label %latch
+
+then:
+  store i64 %i, i64* %slot
+  br label %latch
+
+latch:
+  %i.next = add i64 %i, 1
+  %done = icmp eq i64 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  %r = load i64, i64* %slot
+  ret i64 %r
+}
@@ -0,0 +1,51 @@
+; The zone domain bounds the difference of two full-range values with the
+; comparisons between them that hold at its use. It only runs with a
+; relational budget.
+; RUN: opt -load=%shlibdir/TypeDowncaster%shlibext -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes='function(type-downcaster)' -type-downcaster-relational-budget=10000 -S %s | FileCheck %s --check-prefixes=CHECK,ZONE
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes='function(type-downcaster)' -S %s | FileCheck %s --check-prefixes=CHECK,NOZONE
+
+; lo <= hi <= lo + 4096, so hi - lo is in [0, 4096]
+; CHECK-LABEL: @bounded(
+; ZONE: %len.slot.optimized = alloca i32
+; NOZONE: %len.slot = alloca i64
+; NOZONE-NOT: alloca i32
+define i64 @bounded(i64 %lo, i64 %hi) {
+entry:
+  %len.slot = alloca i64
+  store i64 0, i64* %len.slot
+  %ordered = icmp sle i64 %lo, %hi
+  %lim = add nsw i64 %lo, 4096
+  %close = icmp sle i64 %hi, %lim
+  %ok = and i1 %ordered, %close
+  br i1 %ok, label %then, label %exit
+
+then:
+  %len = sub i64 %hi, %lo
+  store i64 %len, i64* %len.slot
+  br label %exit
+
+exit:
+  %r = load i64, i64* %len.slot
+  ret i64 %r
+}
+
+; Without an upper bound on hi, the difference can be anything
+; CHECK-LABEL: @unbounded(
+; CHECK: %len.slot = alloca i64
+; CHECK-NOT: alloca i32
+define i64 @unbounded(i64 %lo, i64 %hi) {
+entry:
+  %len.slot = alloca i64
+  store i64 0, i64* %len.slot
+  %ordered = icmp sle i64 %lo, %hi
+  br i1 %ordered, label %then, label %exit
+
+then:
+  %len = sub i64 %hi, %lo
+  store i64 %len, i64* %len.slot
+  br label %exit
+
+exit:
+  %r = load i64, i64* %len.slot
+  ret i64 %r
+}
@@ -0,0 +1,34 @@
+; The SMT proof mode narrows a value whose defining expression reuses a term
+; in a way interval arithmetic cannot follow. Without it the value stays wide.
+; REQUIRES: z3
+; RUN: opt -load=%shlibdir/TypeDowncaster%shlibext -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes='function(type-downcaster)' -type-downcaster-smt -S %s | FileCheck %s --check-prefixes=CHECK,SMT
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes='function(type-downcaster)' -S %s | FileCheck %s --check-prefixes=CHECK,NOSMT
+
+; x - (x & -65536) is the low 16 bits of x
+; CHECK-LABEL: @low_bits(
+; SMT: %low.slot.optimized = alloca i32
+; NOSMT: %low.slot = alloca i64
+; NOSMT-NOT: alloca i32
+define i64 @low_bits(i64 %x) {
+entry:
+  %low.slot = alloca i64
+  %high = and i64 %x, -65536
+  %low = sub i64 %x, %high
+  store i64 %low, i64* %low.slot
+  %r = load i64, i64* %low.slot
+  ret i64 %r
+}
+
+; x - (x & -8589934592) keeps 33 bits of x, which do not fit in i32
+; CHECK-LABEL: @too_many_bits(
+; CHECK: %low.slot = alloca i64
+; CHECK-NOT: alloca i32
+define i64 @too_many_bits(i64 %x) {
+entry:
+  %low.slot = alloca i64
+  %high = and i64 %x, -8589934592
+  %low = sub i64 %x, %high
+  store i64 %low, i64* %low.slot
+  %r = load i64, i64* %low.slot
+  ret i64 %r
+}
@@ -0,0 +1,28 @@
+; Call sites that pass narrow arguments get a clone with narrowed
+; parameters. The clone knows the ranges the call sites pass, so the square
+; stored to its slot fits in i32 there, but not in the original.
+; RUN: opt -load=%shlibdir/TypeDowncaster%shlibext -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -type-downcaster-specialization-budget=2000 -S %s | FileCheck %s
+
+; CHECK-LABEL: define i64 @square(i64 %a)
+; CHECK: %slot = alloca i64
+define i64 @square(i64 %a) {
+  %slot = alloca i64
+  %m = mul i64 %a, %a
+  store i64 %m, i64* %slot
+  %v = load i64, i64* %slot
+  ret i64 %v
+}
+
+; CHECK-LABEL: define i64 @caller(
+; CHECK: call i32 @square.specialized(i32
+; CHECK: call i64 @square(i64 %x)
+define i64 @caller(i64 %x) {
+  %a = and i64 %x, 1023
+  %r = call i64 @square(i64 %a)
+  %s = call i64 @square(i64 %x)
+  %t = add i64 %r, %s
+  ret i64 %t
+}
+
+; CHECK-LABEL: define internal i32 @square.specialized(i32 %a)
+; CHECK: %slot.optimized = alloca i32
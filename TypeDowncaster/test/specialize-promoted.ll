@@ -0,0 +1,49 @@
+; A function that is not worth cloning for its stack slots can still be worth
+; cloning for its arithmetic: under the ranges its call sites pass, the clone
+; narrows the multiplication, the addition and the division. Double
+; parameters that receive extended floats count as well.
+; RUN: opt -load=%shlibdir/TypeDowncaster%shlibext -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -type-downcaster-specialization-budget=2000 -S %s | FileCheck %s
+
+; CHECK-LABEL: define i64 @ext(i64 %a, i64 %b)
+; CHECK: mul i64
+; CHECK: sdiv i64
+define i64 @ext(i64 %a, i64 %b) {
+  %m = mul i64 %a, %a
+  %s = add i64 %m, %a
+  %d = sdiv i64 %s, %b
+  ret i64 %d
+}
+
+; CHECK-LABEL: define i64 @caller(
+; CHECK: call i32 @ext.specialized(i32
+define i64 @caller(i64 %x, i64 %y) {
+  %a = and i64 %x, 1023
+  %b = and i64 %y, 1023
+  %r = call i64 @ext(i64 %a, i64 %b)
+  ret i64 %r
+}
+
+define double @extf(double %x) {
+  %slot = alloca double
+  store double %x, double* %slot
+  %v = load double, double* %slot
+  %r = fmul double %v, 2.0
+  ret double %r
+}
+
+; CHECK-LABEL: define double @callerf(
+; CHECK: call double @extf.specialized(float
+define double @callerf(float %f) {
+  %x = fpext float %f to double
+  %r = call double @extf(double %x)
+  ret double %r
+}
+
+; CHECK-LABEL: define internal i32 @ext.specialized(i32 %a, i32 %b)
+; CHECK: mul i32 %a, %a
+; CHECK: add i32
+; CHECK: sdiv i32
+; CHECK: ret i32
+
+; CHECK-LABEL: define internal double @extf.specialized(float %x)
+; CHECK: alloca float
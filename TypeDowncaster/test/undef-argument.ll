@@ -0,0 +1,35 @@
+; An undef argument says nothing about the parameter it is passed to, so
+; the interprocedural facts must not treat it as a value that fits.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes=type-downcaster -S %s | FileCheck %s
+
+; CHECK-LABEL: @high_bits
+; CHECK: %slot = alloca i64
+; CHECK-NOT: alloca i32
+define internal i64 @high_bits(i64 %a) {
+entry:
+  %slot = alloca i64
+  %o = or i64 %a, 1095216660480
+  store i64 %o, i64* %slot
+  %r = load i64, i64* %slot
+  ret i64 %r
+}
+
+; CHECK-LABEL: @low_bits
+; CHECK: %slot.optimized = alloca i32
+define internal i64 @low_bits(i64 %a) {
+entry:
+  %slot = alloca i64
+  %o = add i64 %a, 255
+  store i64 %o, i64* %slot
+  %r = load i64, i64* %slot
+  ret i64 %r
+}
+
+define i64 @caller(i64 %x) {
+entry:
+  %h = call i64 @high_bits(i64 undef)
+  %m = and i64 %x, 4095
+  %l = call i64 @low_bits(i64 %m)
+  %s = add i64 %h, %l
+  ret i64 %s
+}
@@ -0,0 +1,37 @@
+; Undef may take a different value at each use, so the interval analysis
+; must treat it as unknown rather than as a value that fits in any width.
+; RUN: opt -load-pass-plugin=%shlibdir/TypeDowncaster%shlibext -passes='function(type-downcaster)' -S %s | FileCheck %s
+
+; The high bits of %o are always set, whatever %u is
+; CHECK-LABEL: @undef_phi(
+; CHECK: %slot = alloca i64
+; CHECK-NOT: alloca i32
+define i64 @undef_phi(i1 %c) {
+entry:
+  %slot = alloca i64
+  br i1 %c, label %a, label %b
+
+a:
+  br label %merge
+
+b:
+  br label %merge
+
+merge:
+  %u = phi i64 [ undef, %a ], [ undef, %b ]
+  %o = or i64 %u, 1095216660480
+  store i64 %o, i64* %slot
+  %r = load i64, i64* %slot
+  ret i64 %r
+}
+
+; CHECK-LABEL: @masked(
+; CHECK: %slot.optimized = alloca i32
+define i64 @masked(i64 %x) {
+entry:
+  %slot = alloca i64
+  %m = and i64 %x, 65535
+  store i64 %m, i64* %slot
+  %r = load i64, i64* %slot
+  ret i64 %r
+}